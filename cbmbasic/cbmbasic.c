@@ -1,11 +1,25 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../perfect6502.h"
 #include "runtime.h"
 #include "runtime_init.h"
+#include "plugin.h"
 #include <time.h>
 
 int benchmark_mode = 0;
+int fast_traps = 0;
+int hle_math = 0;
+unsigned int memo_entries = 0;
+unsigned int trace_entries = 0;
+int bitmap_scheduler = 0;
+unsigned int group_entries = 0;
+static const char *kernels = NULL;
+static const char *layout = NULL;
+static const char *profile_file = NULL;
+static const char *frozen_file = NULL;
+static int tie_pins = 0;
+static void *profile_state;
 
 
 /*
@@ -20,20 +34,96 @@ RUN
 
 #define SHOW_AVG_SPEED      0
 
+/* --profile-nodes: write the nodes that never toggled when the program ends */
+static void
+save_profile(void)
+{
+	if (saveNodeProfile(profile_state, profile_file) < 0)
+		perror(profile_file);
+}
+
 int
 main(int argc, char *argv[])
 {
 	int clk = 0;
+	char *os_argv[2] = { argv[0], NULL };
 
-	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
-		benchmark_mode = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--benchmark") == 0)
+			benchmark_mode = 1;
+		else if (strcmp(argv[i], "--fast-traps") == 0)
+			fast_traps = 1;
+		else if (strcmp(argv[i], "--hle-math") == 0)
+			hle_math = 1;
+		else if (strcmp(argv[i], "--memo") == 0)
+			memo_entries = 65536;
+		else if (strncmp(argv[i], "--memo=", 7) == 0)
+			memo_entries = atoi(argv[i] + 7);
+		else if (strcmp(argv[i], "--traces") == 0)
+			trace_entries = 4096;
+		else if (strncmp(argv[i], "--traces=", 9) == 0)
+			trace_entries = atoi(argv[i] + 9);
+		else if (strcmp(argv[i], "--group-cache") == 0)
+			group_entries = 4096;
+		else if (strncmp(argv[i], "--group-cache=", 14) == 0)
+			group_entries = atoi(argv[i] + 14);
+		else if (strcmp(argv[i], "--scheduler=bitmap") == 0)
+			bitmap_scheduler = 1;
+		else if (strcmp(argv[i], "--scheduler=list") == 0)
+			bitmap_scheduler = 0;
+		else if (strncmp(argv[i], "--kernels=", 10) == 0)
+			kernels = argv[i] + 10;
+		else if (strncmp(argv[i], "--layout=", 9) == 0)
+			layout = argv[i] + 9;
+		else if (strncmp(argv[i], "--profile-nodes=", 16) == 0)
+			profile_file = argv[i] + 16;
+		else if (strncmp(argv[i], "--frozen-nodes=", 15) == 0)
+			frozen_file = argv[i] + 15;
+		else if (strcmp(argv[i], "--tie-pins") == 0)
+			tie_pins = 1;
+		else if (strcmp(argv[i], "--plugin-native") == 0)
+			plugin_native = PLUGIN_NATIVE_CRNCH | PLUGIN_NATIVE_EVAL | PLUGIN_NATIVE_MEM;
+		else if (strncmp(argv[i], "--plugin-native=", 16) == 0) {
+			plugin_native = 0;
+			if (strstr(argv[i], "crnch"))
+				plugin_native |= PLUGIN_NATIVE_CRNCH;
+			if (strstr(argv[i], "eval"))
+				plugin_native |= PLUGIN_NATIVE_EVAL;
+			if (strstr(argv[i], "mem"))
+				plugin_native |= PLUGIN_NATIVE_MEM;
+		} else
+			os_argv[1] = argv[i]; /* program to run */
+	}
  
 	void *state = initAndResetChip();
+	if (memo_entries)
+		setMemoCache(state, memo_entries);
+	if (trace_entries)
+		setTraceCache(state, trace_entries);
+	if (bitmap_scheduler)
+		setBitmapScheduler(state, 1);
+	if (group_entries)
+		setGroupCache(state, group_entries);
+	if (kernels && !selectKernels(state, kernels))
+		fprintf(stderr, "%s kernels not supported, using %s\n", kernels, readKernels(state));
+	if (layout && !selectNodeLayout(state, layout))
+		fprintf(stderr, "unknown node layout %s, using %s\n", layout, readNodeLayout(state));
+	/* experimental: only removes transistors, it does not simplify the logic behind them */
+	if (tie_pins)
+		fprintf(stderr, "--tie-pins is experimental: %d transistors removed, nothing collapsed\n", tieControlPins(state));
+	if (frozen_file && loadNodeProfile(state, frozen_file) < 0)
+		perror(frozen_file);
+	if (profile_file) {
+		profile_state = state;
+		startNodeProfile(state);
+		atexit(save_profile);
+	}
 
 	/* set up memory for user program */
 	if (init_monitor()) {
 		return 1;
 	}
+	init_os(os_argv[1] ? 2 : 1, os_argv);
 
 #if SHOW_AVG_SPEED
     clock_t end_time;
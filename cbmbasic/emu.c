@@ -1,312 +1,697 @@
+/*
+ * Cycle-exact functional 6502
+ *
+ * This is a conventional instruction-level emulator of the NMOS 6502
+ * (all documented opcodes, including the decimal mode quirks), which
+ * performs the same bus cycles as the real chip, including all dummy
+ * reads and writes. It is used to run code at native speed and hand
+ * off to the transistor-level simulation (and back) at instruction
+ * boundaries, so that only the interesting parts of a run have to be
+ * simulated at transistor level.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include "../types.h"
+#include "../perfect6502.h"
+#include "emu.h"
 
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-
-typedef uint8_t BOOL;
-#define YES 1
-#define NO 0
+/* registers; P only holds the real flags, bits 4 and 5 are always 0 */
+static uint8_t A, X, Y, S, P;
+static uint16_t PC;
 
-typedef uint8_t step_t;
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_5 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+/* the functional core uses the simulation's memory unless told otherwise */
+uint8_t *emu_memory = memory;
+
+emu_write *emu_log;
+int emu_log_count;
+
+/************************************************************
+ *
+ * Bus Cycles
+ *
+ ************************************************************/
+
+/* the instruction currently being executed */
+static instr_info *current;
+
+/* writes of the current instruction, so it can be undone */
+static struct {
+	uint16_t address;
+	uint8_t data;
+} undo[MAX_INSTR_CYCLES];
+static int undo_count;
+
+static inline void
+bus(uint16_t a, uint8_t d, BOOL rw)
+{
+	if (current->cycles < MAX_INSTR_CYCLES) {
+		bus_cycle *b = &current->bus[current->cycles];
+		b->address = a;
+		b->data = d;
+		b->rw = rw;
+	}
+	current->cycles++;
+}
 
-static step_t t; /* step inside the instruction */
-static uint8_t ir; /* instruction register */
-static uint16_t PC;
-static uint8_t A, X, Y, S, P;
-static uint8_t temp_lo, temp_hi;
+static inline uint8_t
+rd(uint16_t a)
+{
+	uint8_t d = emu_memory[a];
+	bus(a, d, YES);
+	return d;
+}
 
-#define TEMP16 (uint16_t)( ((uint16_t)temp_lo) | ((uint16_t)temp_hi) << 8)
+static inline void
+wr(uint16_t a, uint8_t d)
+{
+	bus(a, d, NO);
+	undo[undo_count].address = a;
+	undo[undo_count].data = emu_memory[a];
+	undo_count++;
+	if (emu_log && a >= 0x0200) {
+		emu_log[emu_log_count].address = a;
+		emu_log[emu_log_count].data = emu_memory[a];
+		emu_log_count++;
+	}
+	emu_memory[a] = d;
+}
 
-static uint16_t AB;
-static uint8_t DB;
-static BOOL RW;
-extern uint8_t memory[65536];
+static inline uint8_t
+fetch(void)
+{
+	return rd(PC++);
+}
 
-#define RW_WRITE 0
-#define RW_READ 1
+static inline void
+push(uint8_t d)
+{
+	wr(0x0100 | S--, d);
+}
 
-uint8_t
-LOAD(uint16_t a)
+static inline uint8_t
+pull(void)
 {
-	return memory[a];
+	return rd(0x0100 | ++S);
 }
 
-#define T1 (1<<0)
-#define T2 (1<<1)
-#define T3 (1<<2)
-#define T4 (1<<3)
-#define T5 (1<<4)
-#define T6 (1<<5)
-#define T7 (1<<6)
+/************************************************************
+ *
+ * Addressing Modes
+ *
+ ************************************************************/
 
-#define IS_T1 (t & T1)
-#define IS_T2 (t & T2)
-#define IS_T3 (t & T3)
-#define IS_T4 (t & T4)
-#define IS_T5 (t & T5)
-#define IS_T6 (t & T6)
-#define IS_T7 (t & T7)
+/*
+ * Indexed modes do a dummy read from the address before the high byte
+ * is fixed up. Reads only do this if a page boundary is crossed,
+ * writes and read-modify-write instructions always do it.
+ */
 
-void
-IFETCH(void)
+static inline uint16_t
+addr_zp(void)
 {
-	AB = PC;
-	RW = RW_READ;
-	t = T1;
+	return fetch();
 }
 
-void
-init(void)
+static inline uint16_t
+addr_zpi(uint8_t i)
 {
-	t = T1;
-	ir = 0;
-	PC = 0;
-	A = 0;
-	X = 0;
-	Y = 0;
-	S = 0;
-	P = 0;
-	IFETCH();
+	uint8_t z = fetch();
+	rd(z);
+	return (uint8_t)(z + i);
 }
 
-void
-EOI_INCPC_READPC(void)
+static inline uint16_t
+addr_abs(void)
 {
-	PC++;
-	t <<= 1;
-	AB = PC;
-	RW = RW_READ;
+	uint16_t lo = fetch();
+	uint16_t hi = fetch();
+	return lo | hi << 8;
 }
 
-void
-DB_TO_ADDRLO(void)
+static inline uint16_t
+addr_absi(uint8_t i, BOOL always)
 {
-	temp_lo = DB;
+	uint16_t base = addr_abs();
+	uint16_t a = base + i;
+	if (always || (a & 0xFF00) != (base & 0xFF00))
+		rd((base & 0xFF00) | (a & 0x00FF));
+	return a;
 }
-void
-DB_TO_ADDRHI(void)
+
+static inline uint16_t
+addr_izx(void)
 {
-	temp_hi = DB;
+	uint8_t z = fetch();
+	rd(z);
+	z += X;
+	uint16_t lo = rd(z);
+	uint16_t hi = rd((uint8_t)(z + 1));
+	return lo | hi << 8;
 }
 
-void
-EOI(void)
+static inline uint16_t
+addr_izy(BOOL always)
 {
-	t <<= 1;
+	uint8_t z = fetch();
+	uint16_t lo = rd(z);
+	uint16_t hi = rd((uint8_t)(z + 1));
+	uint16_t base = lo | hi << 8;
+	uint16_t a = base + Y;
+	if (always || (a & 0xFF00) != (base & 0xFF00))
+		rd((base & 0xFF00) | (a & 0x00FF));
+	return a;
 }
 
-void
-EOI_INCPC(void)
+/************************************************************
+ *
+ * Operations
+ *
+ ************************************************************/
+
+static inline void
+setnz(uint8_t v)
 {
-	PC++;
-	EOI();
+	P = (P & ~(FLAG_N | FLAG_Z)) | (v & FLAG_N) | (v ? 0 : FLAG_Z);
 }
 
-void
-EOI_INCPC_READADDR(void)
+static inline void
+setflag(uint8_t flag, BOOL s)
 {
-	EOI_INCPC();
-	AB = TEMP16;
-	RW = RW_READ;
+	if (s)
+		P |= flag;
+	else
+		P &= ~flag;
 }
 
-void
-EOI_INCPC_WRITEADDR(void)
+static inline void
+adc(uint8_t v)
 {
-	EOI_INCPC();
-	AB = TEMP16;
-	RW = RW_WRITE;
+	unsigned int c = P & FLAG_C;
+	unsigned int sum = A + v + c;
+
+	if (P & FLAG_D) {
+		/* NMOS: Z comes from the binary sum, N and V from the intermediate result */
+		unsigned int lo = (A & 0x0F) + (v & 0x0F) + c;
+		if (lo > 0x09)
+			lo = ((lo + 0x06) & 0x0F) + 0x10;
+		unsigned int r = (A & 0xF0) + (v & 0xF0) + lo;
+		setflag(FLAG_Z, !(sum & 0xFF));
+		setflag(FLAG_N, r & 0x80);
+		setflag(FLAG_V, ~(A ^ v) & (A ^ r) & 0x80);
+		if (r >= 0xA0)
+			r += 0x60;
+		setflag(FLAG_C, r >= 0x100);
+		A = r;
+	} else {
+		setflag(FLAG_C, sum >= 0x100);
+		setflag(FLAG_V, ~(A ^ v) & (A ^ sum) & 0x80);
+		A = sum;
+		setnz(A);
+	}
 }
 
-void
-pha(void)
-{
-	printf("%s",__func__);
-	if (IS_T2) {
-		S--;
-		EOI();
-	} else if (IS_T3) {
-		AB = 0x0100 + S;
-		DB = A;
-		RW = RW_WRITE;
-		S++;
-		EOI();
-	} else if (IS_T4) {
-		IFETCH();
+static inline void
+sbc(uint8_t v)
+{
+	int c = P & FLAG_C;
+	unsigned int diff = A - v - !c;
+
+	/* NMOS: all flags come from the binary difference */
+	setflag(FLAG_C, diff < 0x100);
+	setflag(FLAG_V, (A ^ v) & (A ^ diff) & 0x80);
+	setnz(diff);
+
+	if (P & FLAG_D) {
+		int lo = (A & 0x0F) - (v & 0x0F) + c - 1;
+		if (lo < 0)
+			lo = ((lo - 0x06) & 0x0F) - 0x10;
+		int r = (A & 0xF0) - (v & 0xF0) + lo;
+		if (r < 0)
+			r -= 0x60;
+		A = r;
+	} else {
+		A = diff;
 	}
 }
 
-void
-plp(void)
-{
-	printf("%s",__func__);
-	if (IS_T2) {
-		EOI();
-	} else if (IS_T3) {
-		temp_lo = S;
-		temp_hi = 0x01;
-		AB = TEMP16;
-		RW = RW_READ;
-		S++;
-		EOI();
-	} else if (IS_T4) {
-		temp_lo = S;
-		AB = TEMP16;
-		RW = RW_READ;
-		EOI();
-	} else if (IS_T5) {
-		P = DB;
-		IFETCH();
-	}
+static inline void
+cmp(uint8_t r, uint8_t v)
+{
+	unsigned int diff = r - v;
+	setflag(FLAG_C, diff < 0x100);
+	setnz(diff);
 }
 
-void
-txs(void)
+static inline void
+bit(uint8_t v)
 {
-	printf("%s",__func__);
-	/* T2 */
-	S = X;
-	IFETCH();
+	P = (P & ~(FLAG_N | FLAG_V | FLAG_Z)) | (v & (FLAG_N | FLAG_V)) | ((A & v) ? 0 : FLAG_Z);
 }
 
-void
-lda_imm(void)
+static inline uint8_t
+asl(uint8_t v)
 {
-	printf("%s",__func__);
-	/* T2 */
-	A = DB;
-	PC++;
-	IFETCH();
+	setflag(FLAG_C, v & 0x80);
+	v <<= 1;
+	setnz(v);
+	return v;
 }
 
-void
-ldx_imm(void)
+static inline uint8_t
+lsr(uint8_t v)
 {
-	printf("%s",__func__);
-	/* T2 */
-	X = DB;
-	PC++;
-	IFETCH();
+	setflag(FLAG_C, v & 0x01);
+	v >>= 1;
+	setnz(v);
+	return v;
 }
 
-void
-ldy_imm(void)
+static inline uint8_t
+rol(uint8_t v)
 {
-	printf("%s",__func__);
-	/* T2 */
-	Y = DB;
-	PC++;
-	IFETCH();
+	uint8_t c = P & FLAG_C;
+	setflag(FLAG_C, v & 0x80);
+	v = (v << 1) | c;
+	setnz(v);
+	return v;
 }
 
-void
-lda_abs(void)
-{
-	printf("%s",__func__);
-	if (IS_T2) {
-		DB_TO_ADDRLO();
-		EOI_INCPC_READPC();
-	} else if (IS_T3) {
-		DB_TO_ADDRHI();
-		EOI_INCPC_READADDR();
-	} else if (IS_T4) {
-		A = DB;
-		IFETCH();
-	}
+static inline uint8_t
+ror(uint8_t v)
+{
+	uint8_t c = P & FLAG_C;
+	setflag(FLAG_C, v & 0x01);
+	v = (v >> 1) | (c << 7);
+	setnz(v);
+	return v;
 }
 
-void
-sta_abs(void)
-{
-	printf("%s",__func__);
-	if (IS_T2) {
-		DB_TO_ADDRLO();
-		EOI_INCPC_READPC();
-	} else if (IS_T3) {
-		DB_TO_ADDRHI();
-		DB = A;
-		EOI_INCPC_WRITEADDR();
-	} else if (IS_T4) {
-		IFETCH();
-	}
+static inline uint8_t
+inc(uint8_t v)
+{
+	setnz(++v);
+	return v;
 }
 
-static int cycle = 0;
+static inline uint8_t
+dec(uint8_t v)
+{
+	setnz(--v);
+	return v;
+}
 
-void
-emulate_step(void)
+#define ORA(v) setnz(A |= (v))
+#define AND(v) setnz(A &= (v))
+#define EOR(v) setnz(A ^= (v))
+#define ADC(v) adc(v)
+#define SBC(v) sbc(v)
+#define CMP(v) cmp(A, v)
+#define CPX(v) cmp(X, v)
+#define CPY(v) cmp(Y, v)
+#define BIT(v) bit(v)
+#define LDA(v) setnz(A = (v))
+#define LDX(v) setnz(X = (v))
+#define LDY(v) setnz(Y = (v))
+
+/* read-modify-write: the unmodified value is written back first */
+static inline void
+rmw(uint16_t a, uint8_t (*op)(uint8_t))
 {
-	/* memory */
-	if (RW == RW_READ) {
-		printf("PEEK(%04X)=%02X ", AB, memory[AB]);
-		DB = memory[AB];
-	} else {
-		printf("POKE %04X, %02X ", AB, DB);
-		memory[AB] = DB;
-	}
+	uint8_t v = rd(a);
+	wr(a, v);
+	wr(a, op(v));
+}
 
-	//printf("T%d PC=%04X ", t, PC);
-	if (IS_T1) { /* T0: get result of IFETCH */
-		printf("fetch");
-		ir = DB;
-		EOI_INCPC_READPC();
-	} else {
-		//printf ("IR: %02X ", ir);
-		switch (ir) {
-			case 0x28: plp();     break;
-			case 0x48: pha();     break;
-			case 0x8D: sta_abs(); break;
-			case 0x9A: txs();     break;
-			case 0xA0: ldy_imm(); break;
-			case 0xA2: ldx_imm(); break;
-			case 0xA9: lda_imm(); break;
-			case 0xAD: lda_abs(); break;
-			default:
-				printf("unimplemented opcode: %02X\n", ir);
-				exit(0);
+static inline void
+branch(BOOL taken)
+{
+	signed char offset = fetch();
+	if (!taken)
+		return;
+	rd(PC);
+	uint16_t target = PC + offset;
+	if ((target & 0xFF00) != (PC & 0xFF00))
+		rd((PC & 0xFF00) | (target & 0x00FF));
+	PC = target;
+}
+
+/* the implied/accumulator instructions read the next byte and discard it */
+static inline void
+implied(void)
+{
+	rd(PC);
+}
+
+/************************************************************
+ *
+ * Instruction Decoding
+ *
+ ************************************************************/
+
+#define READ_OPS(imm, zp, zpx, abs, absx, absy, izx, izy, OP) \
+	case imm:  OP(fetch()); break; \
+	case zp:   OP(rd(addr_zp())); break; \
+	case zpx:  OP(rd(addr_zpi(X))); break; \
+	case abs:  OP(rd(addr_abs())); break; \
+	case absx: OP(rd(addr_absi(X, NO))); break; \
+	case absy: OP(rd(addr_absi(Y, NO))); break; \
+	case izx:  OP(rd(addr_izx())); break; \
+	case izy:  OP(rd(addr_izy(NO))); break;
+
+#define RMW_OPS(acc, zp, zpx, abs, absx, op) \
+	case acc:  implied(); A = op(A); break; \
+	case zp:   rmw(addr_zp(), op); break; \
+	case zpx:  rmw(addr_zpi(X), op); break; \
+	case abs:  rmw(addr_abs(), op); break; \
+	case absx: rmw(addr_absi(X, YES), op); break;
+
+static BOOL
+execute(uint8_t op)
+{
+	switch (op) {
+		READ_OPS(0x09, 0x05, 0x15, 0x0D, 0x1D, 0x19, 0x01, 0x11, ORA)
+		READ_OPS(0x29, 0x25, 0x35, 0x2D, 0x3D, 0x39, 0x21, 0x31, AND)
+		READ_OPS(0x49, 0x45, 0x55, 0x4D, 0x5D, 0x59, 0x41, 0x51, EOR)
+		READ_OPS(0x69, 0x65, 0x75, 0x6D, 0x7D, 0x79, 0x61, 0x71, ADC)
+		READ_OPS(0xA9, 0xA5, 0xB5, 0xAD, 0xBD, 0xB9, 0xA1, 0xB1, LDA)
+		READ_OPS(0xC9, 0xC5, 0xD5, 0xCD, 0xDD, 0xD9, 0xC1, 0xD1, CMP)
+		READ_OPS(0xE9, 0xE5, 0xF5, 0xED, 0xFD, 0xF9, 0xE1, 0xF1, SBC)
+
+		case 0x85: wr(addr_zp(), A); break;
+		case 0x95: wr(addr_zpi(X), A); break;
+		case 0x8D: wr(addr_abs(), A); break;
+		case 0x9D: wr(addr_absi(X, YES), A); break;
+		case 0x99: wr(addr_absi(Y, YES), A); break;
+		case 0x81: wr(addr_izx(), A); break;
+		case 0x91: wr(addr_izy(YES), A); break;
+
+		case 0xA2: LDX(fetch()); break;
+		case 0xA6: LDX(rd(addr_zp())); break;
+		case 0xB6: LDX(rd(addr_zpi(Y))); break;
+		case 0xAE: LDX(rd(addr_abs())); break;
+		case 0xBE: LDX(rd(addr_absi(Y, NO))); break;
+
+		case 0xA0: LDY(fetch()); break;
+		case 0xA4: LDY(rd(addr_zp())); break;
+		case 0xB4: LDY(rd(addr_zpi(X))); break;
+		case 0xAC: LDY(rd(addr_abs())); break;
+		case 0xBC: LDY(rd(addr_absi(X, NO))); break;
+
+		case 0x86: wr(addr_zp(), X); break;
+		case 0x96: wr(addr_zpi(Y), X); break;
+		case 0x8E: wr(addr_abs(), X); break;
+
+		case 0x84: wr(addr_zp(), Y); break;
+		case 0x94: wr(addr_zpi(X), Y); break;
+		case 0x8C: wr(addr_abs(), Y); break;
+
+		case 0xE0: CPX(fetch()); break;
+		case 0xE4: CPX(rd(addr_zp())); break;
+		case 0xEC: CPX(rd(addr_abs())); break;
+
+		case 0xC0: CPY(fetch()); break;
+		case 0xC4: CPY(rd(addr_zp())); break;
+		case 0xCC: CPY(rd(addr_abs())); break;
+
+		case 0x24: BIT(rd(addr_zp())); break;
+		case 0x2C: BIT(rd(addr_abs())); break;
+
+		RMW_OPS(0x0A, 0x06, 0x16, 0x0E, 0x1E, asl)
+		RMW_OPS(0x2A, 0x26, 0x36, 0x2E, 0x3E, rol)
+		RMW_OPS(0x4A, 0x46, 0x56, 0x4E, 0x5E, lsr)
+		RMW_OPS(0x6A, 0x66, 0x76, 0x6E, 0x7E, ror)
+
+		case 0xE6: rmw(addr_zp(), inc); break;
+		case 0xF6: rmw(addr_zpi(X), inc); break;
+		case 0xEE: rmw(addr_abs(), inc); break;
+		case 0xFE: rmw(addr_absi(X, YES), inc); break;
+
+		case 0xC6: rmw(addr_zp(), dec); break;
+		case 0xD6: rmw(addr_zpi(X), dec); break;
+		case 0xCE: rmw(addr_abs(), dec); break;
+		case 0xDE: rmw(addr_absi(X, YES), dec); break;
+
+		case 0xE8: implied(); setnz(++X); break;
+		case 0xC8: implied(); setnz(++Y); break;
+		case 0xCA: implied(); setnz(--X); break;
+		case 0x88: implied(); setnz(--Y); break;
+
+		case 0xAA: implied(); setnz(X = A); break;
+		case 0x8A: implied(); setnz(A = X); break;
+		case 0xA8: implied(); setnz(Y = A); break;
+		case 0x98: implied(); setnz(A = Y); break;
+		case 0xBA: implied(); setnz(X = S); break;
+		case 0x9A: implied(); S = X; break;
+
+		case 0x18: implied(); P &= ~FLAG_C; break;
+		case 0x38: implied(); P |= FLAG_C; break;
+		case 0x58: implied(); P &= ~FLAG_I; break;
+		case 0x78: implied(); P |= FLAG_I; break;
+		case 0xB8: implied(); P &= ~FLAG_V; break;
+		case 0xD8: implied(); P &= ~FLAG_D; break;
+		case 0xF8: implied(); P |= FLAG_D; break;
+
+		case 0xEA: implied(); break;
+
+		case 0x10: branch(!(P & FLAG_N)); break;
+		case 0x30: branch(P & FLAG_N); break;
+		case 0x50: branch(!(P & FLAG_V)); break;
+		case 0x70: branch(P & FLAG_V); break;
+		case 0x90: branch(!(P & FLAG_C)); break;
+		case 0xB0: branch(P & FLAG_C); break;
+		case 0xD0: branch(!(P & FLAG_Z)); break;
+		case 0xF0: branch(P & FLAG_Z); break;
+
+		case 0x48: implied(); push(A); break;
+		case 0x08: implied(); push(P | FLAG_B | FLAG_5); break;
+		case 0x68: implied(); rd(0x0100 | S); setnz(A = pull()); break;
+		case 0x28: implied(); rd(0x0100 | S); P = pull() & ~(FLAG_B | FLAG_5); break;
+
+		case 0x4C:
+			PC = addr_abs();
+			break;
+		case 0x6C: {
+			/* the high byte of the pointer is not incremented */
+			uint16_t ptr = addr_abs();
+			uint16_t lo = rd(ptr);
+			uint16_t hi = rd((ptr & 0xFF00) | ((ptr + 1) & 0x00FF));
+			PC = lo | hi << 8;
+			break;
 		}
+		case 0x20: {
+			uint16_t lo = fetch();
+			rd(0x0100 | S);
+			push(PC >> 8);
+			push(PC & 0xFF);
+			uint16_t hi = rd(PC);
+			PC = lo | hi << 8;
+			break;
+		}
+		case 0x60: {
+			implied();
+			rd(0x0100 | S);
+			uint16_t lo = pull();
+			uint16_t hi = pull();
+			PC = lo | hi << 8;
+			rd(PC++);
+			break;
+		}
+		case 0x40: {
+			implied();
+			rd(0x0100 | S);
+			P = pull() & ~(FLAG_B | FLAG_5);
+			uint16_t lo = pull();
+			uint16_t hi = pull();
+			PC = lo | hi << 8;
+			break;
+		}
+		case 0x00: {
+			fetch(); /* padding byte */
+			push(PC >> 8);
+			push(PC & 0xFF);
+			push(P | FLAG_B | FLAG_5);
+			P |= FLAG_I;
+			uint16_t lo = rd(0xFFFE);
+			uint16_t hi = rd(0xFFFF);
+			PC = lo | hi << 8;
+			break;
+		}
+
+		default:
+			/* undocumented opcodes are left to the transistors */
+			return NO;
 	}
+	return YES;
+}
 
-	printf("\ncycle:%d phi0:1 AB:%04X D:%02X RnW:%d PC:%04X A:%02X X:%02X Y:%02X SP:%02X P:%02X IR:%02X",
-			cycle,
-			AB,
-	        DB,
-	        RW,
-			PC,
-			A,
-			X,
-			Y,
-			S,
-			P,
-			ir);
+/************************************************************
+ *
+ * Interface
+ *
+ ************************************************************/
 
+void
+emu_get_registers(emu_registers *r)
+{
+	r->a = A;
+	r->x = X;
+	r->y = Y;
+	r->s = S;
+	r->p = P;
+	r->pc = PC;
 }
 
 void
-setup_emu(void)
+emu_set_registers(const emu_registers *r)
 {
-	init();
+	A = r->a;
+	X = r->x;
+	Y = r->y;
+	S = r->s;
+	P = r->p & ~(FLAG_B | FLAG_5);
+	PC = r->pc;
 }
 
 void
 reset_emu(void)
 {
-	init();
-	PC = (uint16_t)( memory[0xFFFC] | (((uint16_t)memory[0xFFFD]) << 8) );
-	printf("PC %x\n", PC);
-	IFETCH();
+	A = X = Y = 0;
+	S = 0xFD;
+	P = FLAG_I;
+	PC = (uint16_t)(emu_memory[0xFFFC] | emu_memory[0xFFFD] << 8);
+}
+
+static void
+undo_instruction(const emu_registers *r)
+{
+	while (undo_count) {
+		undo_count--;
+		emu_memory[undo[undo_count].address] = undo[undo_count].data;
+	}
+	emu_set_registers(r);
+}
+
+/*
+ * Execute one instruction, and describe it the same way
+ * stepInstruction() does for the simulated chip. Returns NO
+ * (without changing any state) for undocumented opcodes.
+ */
+BOOL
+emu_step_instruction(instr_info *info)
+{
+	emu_registers saved;
+	emu_get_registers(&saved);
+
+	current = info;
+	info->cycles = 0;
+	info->pc = PC;
+	undo_count = 0;
+
+	info->opcode = fetch();
+	if (!execute(info->opcode)) {
+		undo_instruction(&saved);
+		return NO;
+	}
+	return YES;
 }
 
+/*
+ * Run functionally until one of the triggers fires. The instruction
+ * that would fire a trigger is not executed (or rolled back), so the
+ * transistor simulation can take over exactly there. The global cycle
+ * counter keeps running, as if the chip had executed the code.
+ */
 int
-emu_measure_instruction(void)
+emu_run(void *state, const emu_trigger *trigger)
 {
+	unsigned long until = trigger->cycle;
+	unsigned long next_event = nextEventCycle(state);
+
+	/* the functional core doesn't know about pins */
+	if (next_event < until)
+		until = next_event;
 
 	for (;;) {
-		printf("cycle %d: ", cycle);
-		emulate_step();
-		printf("\n");
-		cycle++;
+		instr_info info;
+		emu_registers saved;
+
+		if (cycle >= until)
+			return next_event <= cycle ? EMU_STOP_EVENT : EMU_STOP_CYCLE;
+		if (PC == trigger->pc)
+			return EMU_STOP_PC;
+
+		emu_get_registers(&saved);
+		if (!emu_step_instruction(&info))
+			return EMU_STOP_UNIMPLEMENTED;
+
+		if (trigger->access_hi >= trigger->access_lo) {
+			for (int i = 0; i < info.cycles; i++) {
+				uint16_t a = info.bus[i].address;
+				if (a >= trigger->access_lo && a <= trigger->access_hi) {
+					undo_instruction(&saved);
+					return EMU_STOP_ACCESS;
+				}
+			}
+		}
+
+		cycle += 2 * info.cycles;
 	}
-	return 0;
+}
+
+/************************************************************
+ *
+ * Hand-off to and from the Transistor Simulation
+ *
+ ************************************************************/
+
+/*
+ * Take over the state of the chip. It has to be at an instruction
+ * boundary (as left by stepInstruction()), i.e. about to fetch
+ * the next opcode.
+ *
+ * The register write of the previous instruction only happens during
+ * the next opcode fetch, so we feed the chip a NOP first and read the
+ * registers after it. The cycle counter is restored afterwards, but
+ * the chip is left behind at the next boundary: call emu_to_chip()
+ * to continue on transistors.
+ */
+void
+emu_from_chip(void *state)
+{
+	uint16_t fetch_addr = readAddressBus(state);
+	uint8_t saved = memory[fetch_addr];
+	unsigned long saved_cycle = cycle;
+	instr_info info;
+
+	memory[fetch_addr] = 0xEA; /* NOP */
+	stepInstruction(state, &info);
+	memory[fetch_addr] = saved;
+	cycle = saved_cycle;
+
+	A = readA(state);
+	X = readX(state);
+	Y = readY(state);
+	S = readSP(state);
+	P = readP(state) & ~(FLAG_B | FLAG_5);
+	PC = fetch_addr;
+}
+
+/*
+ * Make the chip continue where the functional core stopped. It has to
+ * be at an instruction boundary, which is where emu_from_chip() leaves it.
+ */
+void
+emu_to_chip(void *state)
+{
+	writeRegisters(state, A, X, Y, S, P, PC);
 }
@@ -0,0 +1,46 @@
+#ifndef EMU_H_INCLUDED
+#define EMU_H_INCLUDED
+
+/* requires perfect6502.h */
+
+typedef struct {
+	unsigned char a, x, y, s, p;
+	unsigned short pc;
+} emu_registers;
+
+/* conditions for handing off to the transistor simulation */
+typedef struct {
+	unsigned long cycle;          /* half-cycle counter reaches this */
+	int pc;                       /* about to execute at this address, -1: never */
+	unsigned short access_lo;     /* about to access memory in this range, */
+	unsigned short access_hi;     /* none if access_hi < access_lo */
+} emu_trigger;
+
+enum {
+	EMU_STOP_CYCLE,
+	EMU_STOP_EVENT,
+	EMU_STOP_PC,
+	EMU_STOP_ACCESS,
+	EMU_STOP_UNIMPLEMENTED
+};
+
+extern unsigned char *emu_memory;
+
+/* while emu_log is set, writes above the stack page are logged with the data they replaced */
+typedef struct {
+	unsigned short address;
+	unsigned char data;
+} emu_write;
+
+extern emu_write *emu_log;
+extern int emu_log_count;
+
+void reset_emu(void);
+void emu_get_registers(emu_registers *r);
+void emu_set_registers(const emu_registers *r);
+unsigned char emu_step_instruction(instr_info *info);
+int emu_run(void *state, const emu_trigger *trigger);
+void emu_from_chip(void *state);
+void emu_to_chip(void *state);
+
+#endif /* EMU_H_INCLUDED */
@@ -1,4 +1,6 @@
-extern unsigned char RAM[65536];
+/* the runtime works directly on the memory of the simulated 6502 */
+extern unsigned char memory[65536];
+#define RAM memory
 
 extern unsigned char A, X, Y, S;
 extern unsigned short PC;
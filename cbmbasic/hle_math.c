@@ -0,0 +1,734 @@
+/*
+ * High-level emulation of the BASIC floating point routines
+ *
+ * Floating point arithmetic is where BASIC spends most of its time, and
+ * it is all straight-line zero page code. With HLE math enabled, the
+ * entry points of the arithmetic routines are traps: FADD, FMULT and
+ * FDIV are computed by C versions of the ROM code, the series of the
+ * transcendental functions run on the functional core (calling the C
+ * versions for their arithmetic), and the trap returns to the caller
+ * as if the ROM had executed.
+ *
+ * The C versions follow the control flow of the ROM instruction by
+ * instruction (the labels are the ROM addresses), so the 5-byte results,
+ * the rounding bytes, all zero page temporaries and the registers and
+ * flags on return are the same. Only the bytes the ROM leaves behind
+ * below the stack pointer are not written. Overflow and division by
+ * zero are not handled here: the trap gives up, and the chip runs the
+ * ROM code, which raises the BASIC error.
+ *
+ * All entry points are reached by JSR, JMP or RTS, so the registers
+ * read from the chip at the trap are up to date.
+ */
+
+#include <string.h>
+#include "../types.h"
+#include "../perfect6502.h"
+#include "runtime_init.h"
+#include "emu.h"
+#include "hle_math.h"
+
+/* registers at the trap, imported from runtime_init.c */
+extern unsigned char A, X, Y, S, P;
+extern unsigned short PC;
+extern int N, Z, C;
+
+unsigned long hle_math_calls;
+
+/************************************************************
+ *
+ * 6502 Operations
+ *
+ ************************************************************/
+
+static struct {
+	uint8_t a, x, y;
+	uint8_t n, v, z, c;
+} cpu;
+
+enum {
+	OK,
+	UNWIND,   /* PLA, PLA: return from the caller as well */
+	ERROR     /* BASIC error, let the ROM do it */
+};
+
+#define M(a) memory[(uint16_t)(a)]
+#define ZPX(o) memory[(uint8_t)(cpu.x + (o))]
+
+static inline uint8_t
+nz(uint8_t v)
+{
+	cpu.n = v >> 7;
+	cpu.z = !v;
+	return v;
+}
+
+#define LDA(v) (cpu.a = nz(v))
+#define LDX(v) (cpu.x = nz(v))
+#define LDY(v) (cpu.y = nz(v))
+#define TAY() (cpu.y = nz(cpu.a))
+#define TYA() (cpu.a = nz(cpu.y))
+#define INX() (cpu.x = nz(cpu.x + 1))
+#define INY() (cpu.y = nz(cpu.y + 1))
+#define DEX() (cpu.x = nz(cpu.x - 1))
+#define DEY() (cpu.y = nz(cpu.y - 1))
+#define EOR(v) (cpu.a = nz(cpu.a ^ (v)))
+#define ORA(v) (cpu.a = nz(cpu.a | (v)))
+
+/* BASIC never sets D, the traps give up if it is set */
+static inline void
+ADC(uint8_t v)
+{
+	unsigned s = cpu.a + v + cpu.c;
+	cpu.v = ((cpu.a ^ s) & (v ^ s) & 0x80) != 0;
+	cpu.c = s > 0xFF;
+	cpu.a = nz(s);
+}
+
+static inline void
+SBC(uint8_t v)
+{
+	ADC(v ^ 0xFF);
+}
+
+static inline void
+CMP(uint8_t r, uint8_t v)
+{
+	cpu.c = r >= v;
+	nz(r - v);
+}
+
+static inline void
+BIT(uint8_t v)
+{
+	cpu.n = v >> 7;
+	cpu.v = (v >> 6) & 1;
+	cpu.z = !(cpu.a & v);
+}
+
+static inline uint8_t
+asl(uint8_t v)
+{
+	cpu.c = v >> 7;
+	return nz(v << 1);
+}
+
+static inline uint8_t
+lsr(uint8_t v)
+{
+	cpu.c = v & 1;
+	return nz(v >> 1);
+}
+
+static inline uint8_t
+rol(uint8_t v)
+{
+	uint8_t c = cpu.c;
+	cpu.c = v >> 7;
+	return nz(v << 1 | c);
+}
+
+static inline uint8_t
+ror(uint8_t v)
+{
+	uint8_t c = cpu.c;
+	cpu.c = v & 1;
+	return nz(v >> 1 | c << 7);
+}
+
+#define ASL(m) ((m) = asl(m))
+#define LSR(m) ((m) = lsr(m))
+#define ROL(m) ((m) = rol(m))
+#define ROR(m) ((m) = ror(m))
+#define INC(m) ((m) = nz((m) + 1))
+
+/************************************************************
+ *
+ * ROM Routines
+ *
+ ************************************************************/
+
+/* $BA8C: load ARG from (A/Y) */
+static void
+conupk(void)
+{
+	uint16_t p;
+
+	M(0x22) = cpu.a;
+	M(0x23) = cpu.y;
+	p = M(0x22) | M(0x23) << 8;
+	LDY(0x04);
+	LDA(M(p + cpu.y)); M(0x6D) = cpu.a;
+	DEY(); LDA(M(p + cpu.y)); M(0x6C) = cpu.a;
+	DEY(); LDA(M(p + cpu.y)); M(0x6B) = cpu.a;
+	DEY(); LDA(M(p + cpu.y)); M(0x6E) = cpu.a;
+	EOR(M(0x66)); M(0x6F) = cpu.a;
+	LDA(M(0x6E)); ORA(0x80); M(0x6A) = cpu.a;
+	DEY(); LDA(M(p + cpu.y)); M(0x69) = cpu.a;
+	LDA(M(0x61));
+}
+
+/* $BBFC: FAC = ARG */
+static void
+movfa(void)
+{
+	LDA(M(0x6E)); M(0x66) = cpu.a;
+	LDX(0x05);
+	do {
+		LDA(M(0x68 + cpu.x)); M(0x60 + cpu.x) = cpu.a;
+		DEX();
+	} while (!cpu.z);
+	M(0x70) = cpu.x;
+}
+
+/* $B96F: increment the FAC mantissa */
+static void
+incfac(void)
+{
+	INC(M(0x65)); if (!cpu.z) return;
+	INC(M(0x64)); if (!cpu.z) return;
+	INC(M(0x63)); if (!cpu.z) return;
+	INC(M(0x62));
+}
+
+/* $B947: negate the FAC */
+static void
+negfac(void)
+{
+	LDA(M(0x66)); EOR(0xFF); M(0x66) = cpu.a;
+	LDA(M(0x62)); EOR(0xFF); M(0x62) = cpu.a;
+	LDA(M(0x63)); EOR(0xFF); M(0x63) = cpu.a;
+	LDA(M(0x64)); EOR(0xFF); M(0x64) = cpu.a;
+	LDA(M(0x65)); EOR(0xFF); M(0x65) = cpu.a;
+	LDA(M(0x70)); EOR(0xFF); M(0x70) = cpu.a;
+	INC(M(0x70)); if (!cpu.z) return;
+	incfac();
+}
+
+/* $B983/$B999/$B9B0: shift the number at X right by -A bits */
+enum { SHIFT_B983, SHIFT_B999, SHIFT_B9B0 };
+
+static void
+shift_right(int entry)
+{
+	if (entry == SHIFT_B999)
+		goto b999;
+	if (entry == SHIFT_B9B0)
+		goto b9b0;
+	LDX(0x25);
+b985:
+	LDY(ZPX(4)); M(0x70) = cpu.y;
+	LDY(ZPX(3)); ZPX(4) = cpu.y;
+	LDY(ZPX(2)); ZPX(3) = cpu.y;
+	LDY(ZPX(1)); ZPX(2) = cpu.y;
+	LDY(M(0x68)); ZPX(1) = cpu.y;
+b999:
+	ADC(0x08);
+	if (cpu.n || cpu.z)
+		goto b985;
+	SBC(0x08);
+	TAY();
+	LDA(M(0x70));
+	if (cpu.c)
+		goto b9ba;
+b9a6:
+	ASL(ZPX(1));
+	if (cpu.c)
+		INC(ZPX(1));
+	ROR(ZPX(1));
+	ROR(ZPX(1));
+b9b0:
+	ROR(ZPX(2));
+	ROR(ZPX(3));
+	ROR(ZPX(4));
+	cpu.a = ror(cpu.a);
+	INY();
+	if (!cpu.z)
+		goto b9a6;
+b9ba:
+	cpu.c = 0;
+}
+
+/* $B8F7: FAC = 0 */
+static void
+zerofac(void)
+{
+	LDA(0x00);
+	M(0x61) = cpu.a;
+	M(0x66) = cpu.a;
+}
+
+/* $B8D7: normalize the FAC, $B936/$B938: carry into the exponent */
+enum { NORM_B8D7, NORM_B936, NORM_B938 };
+
+static int
+normalize(int entry)
+{
+	if (entry == NORM_B936)
+		goto b936;
+	if (entry == NORM_B938)
+		goto b938;
+	LDY(0x00);
+	TYA();
+	cpu.c = 0;
+b8db:
+	LDX(M(0x62));
+	if (!cpu.z)
+		goto b929;
+	LDX(M(0x63)); M(0x62) = cpu.x;
+	LDX(M(0x64)); M(0x63) = cpu.x;
+	LDX(M(0x65)); M(0x64) = cpu.x;
+	LDX(M(0x70)); M(0x65) = cpu.x;
+	M(0x70) = cpu.y;
+	ADC(0x08);
+	CMP(cpu.a, 0x20);
+	if (!cpu.z)
+		goto b8db;
+	zerofac();
+	return OK;
+b91d:
+	ADC(0x01);
+	ASL(M(0x70));
+	ROL(M(0x65));
+	ROL(M(0x64));
+	ROL(M(0x63));
+	ROL(M(0x62));
+b929:
+	if (!cpu.n)
+		goto b91d;
+	cpu.c = 1;
+	SBC(M(0x61));
+	if (cpu.c) {
+		zerofac();
+		return OK;
+	}
+	EOR(0xFF);
+	ADC(0x01);
+	M(0x61) = cpu.a;
+b936:
+	if (!cpu.c)
+		return OK;
+b938:
+	INC(M(0x61));
+	if (cpu.z)
+		return ERROR;
+	ROR(M(0x62));
+	ROR(M(0x63));
+	ROR(M(0x64));
+	ROR(M(0x65));
+	ROR(M(0x70));
+	return OK;
+}
+
+/* $BC1B: round the FAC using the rounding byte */
+static int
+round_fac(void)
+{
+	LDA(M(0x61));
+	if (cpu.z)
+		return OK;
+	ASL(M(0x70));
+	if (!cpu.c)
+		return OK;
+	incfac();
+	if (!cpu.z)
+		return OK;
+	return normalize(NORM_B938);
+}
+
+/* $BB8F: FAC mantissa = product/quotient, normalized */
+static int
+movresho(void)
+{
+	LDA(M(0x26)); M(0x62) = cpu.a;
+	LDA(M(0x27)); M(0x63) = cpu.a;
+	LDA(M(0x28)); M(0x64) = cpu.a;
+	LDA(M(0x29)); M(0x65) = cpu.a;
+	return normalize(NORM_B8D7);
+}
+
+/* $BAB7: add the exponents for multiplication and division */
+static int
+muldiv(void)
+{
+	LDA(M(0x69));
+	if (cpu.z)
+		goto bada;
+	cpu.c = 0;
+	ADC(M(0x61));
+	if (!cpu.c) {
+		if (!cpu.n)
+			goto bada;
+	} else {
+		if (cpu.n)
+			return ERROR;
+		cpu.c = 0;
+		BIT(M(0x1410)); /* skips the BPL */
+	}
+	ADC(0x80);
+	M(0x61) = cpu.a;
+	if (cpu.z) {
+		M(0x66) = cpu.a;
+		return OK;
+	}
+	LDA(M(0x6F));
+	M(0x66) = cpu.a;
+	return OK;
+bada:
+	zerofac();
+	return UNWIND;
+}
+
+/* $B86A: FAC = ARG + FAC, with Z set if the FAC is 0 */
+static int
+faddt(void)
+{
+	if (cpu.z) {
+		movfa();
+		return OK;
+	}
+	LDX(M(0x70)); M(0x56) = cpu.x;
+	LDX(0x69);
+	LDA(M(0x69));
+	TAY();
+	if (cpu.z)
+		return OK;
+	cpu.c = 1;
+	SBC(M(0x61));
+	if (cpu.z)
+		goto b8a3;
+	if (cpu.c) {
+		M(0x61) = cpu.y;
+		LDY(M(0x6E)); M(0x66) = cpu.y;
+		EOR(0xFF);
+		ADC(0x00);
+		LDY(0x00); M(0x56) = cpu.y;
+		LDX(0x61);
+	} else {
+		LDY(0x00); M(0x70) = cpu.y;
+	}
+	CMP(cpu.a, 0xF9);
+	if (cpu.n) {
+		/* the shift always returns with C clear */
+		shift_right(SHIFT_B999);
+		goto b8a3;
+	}
+	TAY();
+	LDA(M(0x70));
+	LSR(ZPX(1));
+	shift_right(SHIFT_B9B0);
+b8a3:
+	BIT(M(0x6F));
+	if (!cpu.n) {
+		ADC(M(0x56)); M(0x70) = cpu.a;
+		LDA(M(0x65)); ADC(M(0x6D)); M(0x65) = cpu.a;
+		LDA(M(0x64)); ADC(M(0x6C)); M(0x64) = cpu.a;
+		LDA(M(0x63)); ADC(M(0x6B)); M(0x63) = cpu.a;
+		LDA(M(0x62)); ADC(M(0x6A)); M(0x62) = cpu.a;
+		return normalize(NORM_B936);
+	}
+	LDY(0x61);
+	CMP(cpu.x, 0x69);
+	if (!cpu.z)
+		LDY(0x69);
+	cpu.c = 1;
+	EOR(0xFF);
+	ADC(M(0x56)); M(0x70) = cpu.a;
+	LDA(M(cpu.y + 4)); SBC(ZPX(4)); M(0x65) = cpu.a;
+	LDA(M(cpu.y + 3)); SBC(ZPX(3)); M(0x64) = cpu.a;
+	LDA(M(cpu.y + 2)); SBC(ZPX(2)); M(0x63) = cpu.a;
+	LDA(M(cpu.y + 1)); SBC(ZPX(1)); M(0x62) = cpu.a;
+	if (!cpu.c)
+		negfac();
+	return normalize(NORM_B8D7);
+}
+
+/* $BA59/$BA5E: add ARG times the bits of A to the product */
+static void
+mltply(BOOL skip_zero)
+{
+	if (skip_zero && cpu.z) {
+		shift_right(SHIFT_B983);
+		return;
+	}
+	cpu.a = lsr(cpu.a);
+	ORA(0x80);
+	do {
+		TAY();
+		if (cpu.c) {
+			cpu.c = 0;
+			LDA(M(0x29)); ADC(M(0x6D)); M(0x29) = cpu.a;
+			LDA(M(0x28)); ADC(M(0x6C)); M(0x28) = cpu.a;
+			LDA(M(0x27)); ADC(M(0x6B)); M(0x27) = cpu.a;
+			LDA(M(0x26)); ADC(M(0x6A)); M(0x26) = cpu.a;
+		}
+		ROR(M(0x26));
+		ROR(M(0x27));
+		ROR(M(0x28));
+		ROR(M(0x29));
+		ROR(M(0x70));
+		TYA();
+		cpu.a = lsr(cpu.a);
+	} while (!cpu.z);
+}
+
+/* $BA2B: FAC = ARG * FAC, with Z set if the FAC is 0 */
+static int
+fmultt(void)
+{
+	int r;
+
+	if (cpu.z)
+		return OK;
+	if ((r = muldiv()) != OK)
+		return r == UNWIND ? OK : r;
+	LDA(0x00);
+	M(0x26) = M(0x27) = M(0x28) = M(0x29) = cpu.a;
+	LDA(M(0x70)); mltply(YES);
+	LDA(M(0x65)); mltply(YES);
+	LDA(M(0x64)); mltply(YES);
+	LDA(M(0x63)); mltply(YES);
+	LDA(M(0x62)); mltply(NO);
+	return movresho();
+}
+
+/* $BB12: FAC = ARG / FAC, with Z set if the FAC is 0 */
+static int
+fdivt(void)
+{
+	uint8_t saved_n, saved_v, saved_z, saved_c;
+	int r;
+
+	if (cpu.z)
+		return ERROR;
+	if (round_fac() != OK)
+		return ERROR;
+	LDA(0x00);
+	cpu.c = 1;
+	SBC(M(0x61));
+	M(0x61) = cpu.a;
+	if ((r = muldiv()) != OK)
+		return r == UNWIND ? OK : r;
+	INC(M(0x61));
+	if (cpu.z)
+		return ERROR;
+	LDX(0xFC);
+	LDA(0x01);
+bb29:
+	LDY(M(0x6A)); CMP(cpu.y, M(0x62)); if (!cpu.z) goto bb3f;
+	LDY(M(0x6B)); CMP(cpu.y, M(0x63)); if (!cpu.z) goto bb3f;
+	LDY(M(0x6C)); CMP(cpu.y, M(0x64)); if (!cpu.z) goto bb3f;
+	LDY(M(0x6D)); CMP(cpu.y, M(0x65));
+bb3f:
+	/* PHP */
+	saved_n = cpu.n; saved_v = cpu.v; saved_z = cpu.z; saved_c = cpu.c;
+	cpu.a = rol(cpu.a);
+	if (cpu.c) {
+		INX();
+		ZPX(0x29) = cpu.a;
+		if (cpu.z) {
+			LDA(0x40);
+		} else if (!cpu.n) {
+			cpu.a = asl(cpu.a);
+			cpu.a = asl(cpu.a);
+			cpu.a = asl(cpu.a);
+			cpu.a = asl(cpu.a);
+			cpu.a = asl(cpu.a);
+			cpu.a = asl(cpu.a);
+			M(0x70) = cpu.a;
+			cpu.n = saved_n; cpu.v = saved_v; cpu.z = saved_z; cpu.c = saved_c;
+			return movresho();
+		} else {
+			LDA(0x01);
+		}
+	}
+	/* PLP */
+	cpu.n = saved_n; cpu.v = saved_v; cpu.z = saved_z; cpu.c = saved_c;
+	if (cpu.c) {
+		TAY();
+		LDA(M(0x6D)); SBC(M(0x65)); M(0x6D) = cpu.a;
+		LDA(M(0x6C)); SBC(M(0x64)); M(0x6C) = cpu.a;
+		LDA(M(0x6B)); SBC(M(0x63)); M(0x6B) = cpu.a;
+		LDA(M(0x6A)); SBC(M(0x62)); M(0x6A) = cpu.a;
+		TYA();
+	}
+	ASL(M(0x6D));
+	ROL(M(0x6C));
+	ROL(M(0x6B));
+	ROL(M(0x6A));
+	if (cpu.c)
+		goto bb3f;
+	if (cpu.n)
+		goto bb29;
+	goto bb3f;
+}
+
+static int fadd(void) { conupk(); return faddt(); }
+static int fmult(void) { conupk(); return fmultt(); }
+static int fdiv(void) { conupk(); return fdivt(); }
+
+/************************************************************
+ *
+ * Traps
+ *
+ ************************************************************/
+
+/* run a C version on the registers, NO (and nothing changed) if it gives up */
+static BOOL
+run_native(int (*routine)(void), emu_registers *r)
+{
+	static uint8_t zp[256];
+
+	if (r->p & 0x08)
+		return NO;
+	memcpy(zp, memory, sizeof(zp));
+	cpu.a = r->a;
+	cpu.x = r->x;
+	cpu.y = r->y;
+	cpu.n = r->p >> 7;
+	cpu.v = (r->p >> 6) & 1;
+	cpu.z = (r->p >> 1) & 1;
+	cpu.c = r->p & 1;
+	if (routine() != OK) {
+		memcpy(memory, zp, sizeof(zp));
+		return NO;
+	}
+	r->a = cpu.a;
+	r->x = cpu.x;
+	r->y = cpu.y;
+	r->p = (r->p & 0x3C) | cpu.n << 7 | cpu.v << 6 | cpu.z << 1 | cpu.c;
+	hle_math_calls++;
+	return YES;
+}
+
+static int
+native(int (*routine)(void))
+{
+	emu_registers r = { A, X, Y, S, (P & 0x7C) | N << 7 | Z << 1 | C, PC };
+
+	if (!run_native(routine, &r))
+		return 0;
+	A = r.a;
+	X = r.x;
+	Y = r.y;
+	P = r.p;
+	N = P >> 7;
+	Z = (P >> 1) & 1;
+	C = P & 1;
+	return 1;
+}
+
+static const struct {
+	unsigned short address;
+	int (*routine)(void);
+} arithmetic[] = {
+	{ 0xB867, fadd },         /* FADD:  FAC = (A/Y) + FAC */
+	{ 0xB86A, faddt },        /* FADDT: FAC = ARG + FAC */
+	{ 0xBA28, fmult },        /* FMULT: FAC = (A/Y) * FAC */
+	{ 0xBA2B, fmultt },       /* FMULTT: FAC = ARG * FAC */
+	{ 0xBB0F, fdiv },         /* FDIV:  FAC = (A/Y) / FAC */
+	{ 0xBB12, fdivt },        /* FDIVT: FAC = ARG / FAC */
+};
+
+static int (*
+arithmetic_at(unsigned short address))(void)
+{
+	for (int i = 0; i < sizeof(arithmetic) / sizeof(arithmetic[0]); i++)
+		if (arithmetic[i].address == address)
+			return arithmetic[i].routine;
+	return NULL;
+}
+
+#define MAX_FUNCTIONAL_INSTRUCTIONS 1000000
+#define MAX_FUNCTIONAL_WRITES 256
+
+/*
+ * The transcendental functions are series evaluations built on the
+ * arithmetic routines. The series run on the functional core up to
+ * their final RTS, which the trap then does; the arithmetic they call
+ * is done by the C versions. They give up on errors, which leave
+ * through $A437, and on anything that looks like a KERNAL call. To
+ * give up, the zero page and the stack are restored from a copy, and
+ * any other writes from the functional core's log.
+ */
+static int
+functional(void)
+{
+	static uint8_t saved[0x200];
+	static emu_write log[MAX_FUNCTIONAL_WRITES];
+	emu_registers r = { A, X, Y, S, (P & 0x7C) | N << 7 | Z << 1 | C, PC };
+	unsigned long calls = hle_math_calls;
+	instr_info info;
+
+	memcpy(saved, memory, sizeof(saved));
+	emu_memory = memory;
+	emu_log = log;
+	emu_log_count = 0;
+	for (int i = 0; i < MAX_FUNCTIONAL_INSTRUCTIONS; i++) {
+		if (r.s == S && memory[r.pc] == 0x60) /* RTS */
+			goto done;
+		if (r.pc == 0xA437 || r.pc >= 0xFF90 || emu_log_count > MAX_FUNCTIONAL_WRITES - MAX_INSTR_CYCLES)
+			break;
+		int (*routine)(void) = arithmetic_at(r.pc);
+		if (routine && run_native(routine, &r)) {
+			/* a JMP at the end of the series: its RTS is ours */
+			if (r.s == S)
+				goto done;
+			r.pc = (memory[0x100 | (uint8_t)(r.s + 1)] | memory[0x100 | (uint8_t)(r.s + 2)] << 8) + 1;
+			r.s += 2;
+			continue;
+		}
+		emu_set_registers(&r);
+		if (!emu_step_instruction(&info))
+			break;
+		emu_get_registers(&r);
+	}
+	while (emu_log_count--)
+		memory[log[emu_log_count].address] = log[emu_log_count].data;
+	emu_log = NULL;
+	memcpy(memory, saved, sizeof(saved));
+	hle_math_calls = calls;
+	return 0;
+
+done:
+	emu_log = NULL;
+	A = r.a;
+	X = r.x;
+	Y = r.y;
+	P = r.p;
+	N = P >> 7;
+	Z = (P >> 1) & 1;
+	C = P & 1;
+	hle_math_calls = calls + 1;
+	return 1;
+}
+
+static int trap_fadd(void) { return native(fadd); }
+static int trap_faddt(void) { return native(faddt); }
+static int trap_fmult(void) { return native(fmult); }
+static int trap_fmultt(void) { return native(fmultt); }
+static int trap_fdiv(void) { return native(fdiv); }
+static int trap_fdivt(void) { return native(fdivt); }
+
+static const struct {
+	unsigned short address;
+	trap_handler handler;
+} hle_math_traps[] = {
+	{ 0xB867, trap_fadd },    /* FADD:  FAC = (A/Y) + FAC */
+	{ 0xB86A, trap_faddt },   /* FADDT: FAC = ARG + FAC */
+	{ 0xBA28, trap_fmult },   /* FMULT: FAC = (A/Y) * FAC */
+	{ 0xBA2B, trap_fmultt },  /* FMULTT: FAC = ARG * FAC */
+	{ 0xBB0F, trap_fdiv },    /* FDIV:  FAC = (A/Y) / FAC */
+	{ 0xBB12, trap_fdivt },   /* FDIVT: FAC = ARG / FAC */
+	{ 0xBF71, functional },   /* SQR */
+	{ 0xB9EA, functional },   /* LOG */
+	{ 0xBFED, functional },   /* EXP */
+	{ 0xE26B, functional },   /* SIN */
+};
+
+void
+hle_math_register_traps(void)
+{
+	for (int i = 0; i < sizeof(hle_math_traps) / sizeof(hle_math_traps[0]); i++)
+		register_trap(hle_math_traps[i].address, hle_math_traps[i].handler);
+}
@@ -0,0 +1,3 @@
+extern unsigned long hle_math_calls;
+
+void hle_math_register_traps(void);
@@ -42,10 +42,20 @@
  * but stores them verbatim and compares strings when during execution, which
  * is very bad for performance. Also, there is currently no demo code for
  * added functions.
+ *
+ * The plugin hooks also carry native versions of the hot paths of the
+ * interpreter, each of which can be switched on separately (plugin_native):
+ *
+ * - the tokenizer
+ * - variable lookup in expressions
+ * - FILL start,length,byte and COPY from,to,length statements
+ *
+ * Switching any of them on turns on the plugin at startup.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #ifdef _WIN32
 #include <windows.h>
@@ -54,6 +64,9 @@
 #include "plugin.h"
 #include "glue.h"
 #include "console.h"
+#include "runtime_init.h"
+
+int plugin_native = 0;
 
 static unsigned short
 get_chrptr(void) {
@@ -86,16 +99,41 @@ compare(const char *s1) {
 /*
  * Continuation
  *
- * This will put a magic value onto the stack and run the main
- * function again with another PC value as a start address.
- * When the code returns, it will find the magic value, and
- * the main function will quit, so we end up here again.
+ * This will put a magic value onto the stack and run the chip
+ * from another PC value as a start address. When the code
+ * returns, it will fetch from the magic address, and the
+ * monitor hands control back to us.
  */
 static void
 call(unsigned short pc) {
-	PC = pc;
 	PUSH_WORD(MAGIC_CONTINUATION-1);
-	main(0,0);
+	monitor_call(pc, MAGIC_CONTINUATION);
+}
+
+/*
+ * Return to the caller of the hooked routine
+ */
+static unsigned short
+rts(void) {
+	unsigned short pc = STACK16(S+1) + 1;
+	S += 2;
+	return pc;
+}
+
+static void
+cmp(unsigned char r, unsigned char v) {
+	unsigned short temp16 = (unsigned short)r - (unsigned short)v;
+	SETNC(temp16);
+	SETSZ(temp16&0xFF);
+}
+
+/* SEC, SBC #v */
+static void
+sbc(unsigned char v) {
+	unsigned short temp16 = (unsigned short)A - (unsigned short)v;
+	SETNC(temp16);
+	A = (unsigned char)temp16;
+	SETSZ(A);
 }
 
 static void
@@ -187,11 +225,116 @@ plugin_main(void) {
 	return 0;
 }
 
+/*
+ * Native Tokenizer
+ *
+ * This is the ROM tokenizer at $A57C in C, instruction by instruction,
+ * so it leaves the same bytes in the input buffer and the zero page,
+ * and the same registers. The keywords come from the ROM's table.
+ */
+#define KEYWORDS 0xA09E
+
+static unsigned short
+crnch(void) {
+	X = RAM[0x7A];
+	Y = 0x04;
+	RAM[0x0F] = Y;
+A582:
+	A = RAM[0x0200+X]; SETSZ(A);
+	if (!N) goto A58E;
+	cmp(A, 0xFF);
+	if (Z) goto A5C9;
+	X++; SETSZ(X);
+	if (!Z) goto A582;
+A58E:
+	cmp(A, 0x20);
+	if (Z) goto A5C9;
+	RAM[0x08] = A;
+	cmp(A, 0x22);
+	if (Z) goto A5EE;
+	N = RAM[0x0F] >> 7; /* BIT $0F */
+	Z = !(A & RAM[0x0F]);
+	if (RAM[0x0F] & 0x40) goto A5C9; /* in DATA */
+	cmp(A, 0x3F);
+	if (!Z) goto A5A4;
+	A = 0x99; SETSZ(A); /* "?" is PRINT */
+	goto A5C9;
+A5A4:
+	cmp(A, 0x30);
+	if (!C) goto A5AC;
+	cmp(A, 0x3C);
+	if (!C) goto A5C9;
+A5AC:
+	RAM[0x71] = Y;
+	Y = 0x00; SETSZ(Y);
+	RAM[0x0B] = Y;
+	Y--; SETSZ(Y);
+	RAM[0x7A] = X;
+	X--; SETSZ(X);
+A5B6:
+	Y++; SETSZ(Y);
+	X++; SETSZ(X);
+A5B8:
+	A = RAM[0x0200+X];
+	sbc(RAM[KEYWORDS+Y]);
+	if (Z) goto A5B6;
+	cmp(A, 0x80);
+	if (!Z) goto A5F5;
+	A |= RAM[0x0B]; SETSZ(A); /* token */
+A5C7:
+	Y = RAM[0x71]; SETSZ(Y);
+A5C9:
+	X++; SETSZ(X);
+	Y++; SETSZ(Y);
+	RAM[0x01FB+Y] = A;
+	A = RAM[0x01FB+Y]; SETSZ(A);
+	if (Z) goto A609;
+	sbc(0x3A);
+	if (Z) goto A5DC; /* ":" */
+	cmp(A, 0x49);
+	if (!Z) goto A5DE; /* DATA */
+A5DC:
+	RAM[0x0F] = A;
+A5DE:
+	sbc(0x55);
+	if (!Z) goto A582; /* REM */
+	RAM[0x08] = A;
+A5E5:
+	A = RAM[0x0200+X]; SETSZ(A);
+	if (Z) goto A5C9;
+	cmp(A, RAM[0x08]);
+	if (Z) goto A5C9;
+A5EE:
+	Y++; SETSZ(Y);
+	RAM[0x01FB+Y] = A;
+	X++; SETSZ(X);
+	if (!Z) goto A5E5;
+A5F5:
+	X = RAM[0x7A]; SETSZ(X); /* next keyword */
+	RAM[0x0B]++; SETSZ(RAM[0x0B]);
+A5F9:
+	Y++; SETSZ(Y);
+	A = RAM[KEYWORDS-1+Y]; SETSZ(A);
+	if (!N) goto A5F9;
+	A = RAM[KEYWORDS+Y]; SETSZ(A);
+	if (!Z) goto A5B8;
+	A = RAM[0x0200+X]; SETSZ(A);
+	if (!N) goto A5C7;
+A609:
+	RAM[0x01FD+Y] = A;
+	RAM[0x7B]--; SETSZ(RAM[0x7B]);
+	A = 0xFF; SETSZ(A);
+	RAM[0x7A] = A;
+	return rts();
+}
+
 /*
  * Tokenize BASIC Text
  */
 unsigned short
 plugin_crnch(void) {
+	if (plugin_native & PLUGIN_NATIVE_CRNCH)
+		return crnch();
 	return 0;
 }
 
@@ -278,11 +421,194 @@ plugin_gone(void) {
 		if (compare("QUIT")) {
 			exit(0);
 		}
+
+		/*
+		 * these are bulk memory operations that
+		 * would be slow POKE loops in BASIC
+		 */
+		if ((plugin_native & PLUGIN_NATIVE_MEM) && compare("FILL")) {
+			unsigned short a, n;
+			unsigned char b;
+			a = get_word();
+			check_comma();
+			n = get_word();
+			check_comma();
+			b = get_byte();
+			while (n--)
+				RAM[a++] = b;
+
+			continue;
+		}
+		if ((plugin_native & PLUGIN_NATIVE_MEM) && compare("COPY")) {
+			unsigned short from, to, n;
+			from = get_word();
+			check_comma();
+			to = get_word();
+			check_comma();
+			n = get_word();
+			/* overlapping ranges work like memmove() */
+			if ((unsigned short)(to - from) < n) {
+				while (n--)
+					RAM[(unsigned short)(to + n)] = RAM[(unsigned short)(from + n)];
+			} else {
+				while (n--)
+					RAM[to++] = RAM[from++];
+			}
+
+			continue;
+		}
 		break;
 	}
 	return 0;
 }
 
+/*
+ * Native Variable Lookup
+ *
+ * This handles the most common case of EVAL ($AE86), a float variable
+ * that exists, by following the ROM code through PTRGET and MOVFM in C,
+ * instruction by instruction. Everything else (numbers, operators,
+ * strings, integers, arrays, new variables) is left to the ROM, with
+ * the state restored.
+ */
+
+/* $B113: C = 1 if A is a letter */
+static void
+isletc(void) {
+	cmp(A, 0x41);
+	if (!C) return;
+	sbc(0x5B);
+	sbc(0xA5);
+}
+
+static unsigned short
+eval(void) {
+	unsigned char zp[256];
+	unsigned char a = A, x = X, y = Y, n = N, z = Z, c = C;
+	unsigned short p, temp16;
+
+	memcpy(zp, RAM, sizeof(zp));
+	A = 0x00; SETSZ(A);
+	RAM[0x0D] = A;
+	CHRGET();
+	if (!C) goto rom; /* number */
+	isletc();
+	if (!C) goto rom;
+
+	/* PTRGET */
+	X = 0x00; SETSZ(X);
+	CHRGOT();
+	RAM[0x0C] = X;
+	RAM[0x45] = A;
+	CHRGOT();
+	isletc();
+	if (!C) goto rom;
+	X = 0x00; SETSZ(X);
+	RAM[0x0D] = X;
+	RAM[0x0E] = X;
+	CHRGET();
+	if (!C) goto B0AF;
+	isletc();
+	if (!C) goto B0BA;
+B0AF:
+	X = A; SETSZ(X);
+B0B0:
+	CHRGET();
+	if (!C) goto B0B0;
+	isletc();
+	if (C) goto B0B0;
+B0BA:
+	if (A == '$' || A == '%') goto rom;
+	RAM[0x46] = X;
+	A |= RAM[0x10];
+	sbc(0x28);
+	if (Z) goto rom; /* array */
+	Y = 0x00; SETSZ(Y);
+	RAM[0x10] = Y;
+	A = RAM[0x2D]; SETSZ(A);
+	X = RAM[0x2E]; SETSZ(X);
+B0EF:
+	RAM[0x60] = X;
+B0F1:
+	RAM[0x5F] = A;
+	cmp(X, RAM[0x30]);
+	if (!Z) goto B0FB;
+	cmp(A, RAM[0x2F]);
+	if (Z) goto rom; /* new variable */
+B0FB:
+	p = RAM[0x5F] | RAM[0x60]<<8;
+	A = RAM[0x45]; SETSZ(A);
+	cmp(A, RAM[(unsigned short)(p+Y)]);
+	if (!Z) goto B109;
+	A = RAM[0x46]; SETSZ(A);
+	Y++; SETSZ(Y);
+	cmp(A, RAM[(unsigned short)(p+Y)]);
+	if (Z) goto B185;
+	Y--; SETSZ(Y);
+B109:
+	temp16 = RAM[0x5F] + 0x07; /* CLC, ADC #$07 */
+	C = temp16 > 0xFF;
+	A = (unsigned char)temp16; SETSZ(A);
+	if (!C) goto B0F1;
+	X++; SETSZ(X);
+	if (!Z) goto B0EF;
+	goto rom;
+B185:
+	temp16 = RAM[0x5F] + 0x02;
+	C = temp16 > 0xFF;
+	A = (unsigned char)temp16; SETSZ(A);
+	Y = RAM[0x60]; SETSZ(Y);
+	if (C) {
+		Y++; SETSZ(Y);
+	}
+	RAM[0x47] = A;
+	RAM[0x48] = Y;
+
+	/* back in EVAL, a float */
+	RAM[0x64] = A;
+	RAM[0x65] = Y;
+	X = RAM[0x45]; SETSZ(X);
+	Y = RAM[0x46]; SETSZ(Y);
+	A = RAM[0x0D]; SETSZ(A);
+	N = RAM[0x0E] >> 7; /* BIT $0E */
+	Z = !(A & RAM[0x0E]);
+	A = RAM[0x64];
+	sbc(0x00);
+	A = RAM[0x65];
+	temp16 = (unsigned short)A - 0xA0 - (1 - C);
+	SETNC(temp16);
+	A = (unsigned char)temp16; SETSZ(A);
+	if (C) goto rom; /* constant in ROM */
+
+	/* MOVFM */
+	A = RAM[0x64]; SETSZ(A);
+	Y = RAM[0x65]; SETSZ(Y);
+	RAM[0x22] = A;
+	RAM[0x23] = Y;
+	p = RAM[0x22] | RAM[0x23]<<8;
+	RAM[0x65] = RAM[(unsigned short)(p+4)];
+	RAM[0x64] = RAM[(unsigned short)(p+3)];
+	RAM[0x63] = RAM[(unsigned short)(p+2)];
+	A = RAM[(unsigned short)(p+1)];
+	RAM[0x66] = A;
+	RAM[0x62] = A | 0x80;
+	Y = 0x00;
+	A = RAM[p]; SETSZ(A);
+	RAM[0x61] = A;
+	RAM[0x70] = Y;
+	return rts();
+
+rom:
+	memcpy(RAM, zp, sizeof(zp));
+	A = a;
+	X = x;
+	Y = y;
+	N = n;
+	Z = z;
+	C = c;
+	return 0;
+}
+
 /*
  * BASIC Token Evaluation
  *
@@ -291,5 +617,7 @@ plugin_gone(void) {
  */
 unsigned short
 plugin_eval(void) {
+	if (plugin_native & PLUGIN_NATIVE_EVAL)
+		return eval();
 	return 0;
 }
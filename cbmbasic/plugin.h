@@ -1,3 +1,10 @@
+/* native fast paths in the plugin hooks */
+#define PLUGIN_NATIVE_CRNCH	1	/* tokenizer */
+#define PLUGIN_NATIVE_EVAL	2	/* variable lookup */
+#define PLUGIN_NATIVE_MEM	4	/* FILL and COPY */
+
+extern int plugin_native;
+
 unsigned short plugin_error(void);
 unsigned short plugin_main(void);
 unsigned short plugin_crnch(void);
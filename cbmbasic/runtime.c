@@ -43,8 +43,7 @@
 #include "plugin.h"
 #include "glue.h"
 #include "console.h"
-
-unsigned char RAM[65536];
+#include "runtime_init.h"
 
 int
 stack4(unsigned short a, unsigned short b, unsigned short c, unsigned short d) {
@@ -240,7 +239,8 @@ MEMTOP(void) {
 	 * if we want to turn on the plugin
 	 * automatically at start, we can do it here.
 	 */
-	//plugin_on();
+	if (plugin_native)
+		plugin_on();
 }
 
 /* MEMBOT */
@@ -872,54 +872,90 @@ IOBASE(void) {
 		Y = CIA >> 8;
 }
 
-int
-kernal_dispatch(void) {
-//{ printf("kernal_dispatch $%04X; ", PC); int i; printf("stack (%02X): ", S); for (i=S+1; i<0x100; i++) { printf("%02X ", RAM[0x0100+i]); } printf("\n"); }
-	unsigned short new_pc;
-	switch(PC) {
-		case 0x0073:	CHRGET();	break;
-		case 0x0079:	CHRGOT();	break;
-		case 0xFF90:	SETMSG();	break;
-		case 0xFF99:	MEMTOP();	break;
-		case 0xFF9C:	MEMBOT();	break;
-		case 0xFFB7:	READST();	break;
-		case 0xFFBA:	SETLFS();	break;
-		case 0xFFBD:	SETNAM();	break;
-		case 0xFFC0:	OPEN();		break;
-		case 0xFFC3:	CLOSE();	break;
-		case 0xFFC6:	CHKIN();	break;
-		case 0xFFC9:	CHKOUT();	break;
-		case 0xFFCC:	CLRCHN();	break;
-		case 0xFFCF:	CHRIN();	break;
-		case 0xFFD2:	CHROUT();	break;
-		case 0xFFD5:	LOAD();		break;
-		case 0xFFD8:	SAVE();		break;
-		case 0xFFDB:	SETTIM();	break;
-		case 0xFFDE:	RDTIM();	break;
-		case 0xFFE1:	STOP();		break;
-		case 0xFFE4:	GETIN();	break;
-		case 0xFFE7:	CLALL();	break;
-		case 0xFFF0:	PLOT();		break;
-		case 0xFFF3:	IOBASE();	break;
-
-		case 0:		plugin_off(); S+=2; break;
-		case 1:		plugin_on(); S+=2; break;
-
-		case MAGIC_ERROR:	new_pc = plugin_error(); PUSH_WORD(new_pc? new_pc-1:orig_error-1); break;
-		case MAGIC_MAIN:	new_pc = plugin_main(); PUSH_WORD(new_pc? new_pc-1:orig_main-1); break;
-		case MAGIC_CRNCH:	new_pc = plugin_crnch(); PUSH_WORD(new_pc? new_pc-1:orig_crnch-1); break;
-		case MAGIC_QPLOP:	new_pc = plugin_qplop(); PUSH_WORD(new_pc? new_pc-1:orig_qplop-1); break;
-		case MAGIC_GONE:	new_pc = plugin_gone(); PUSH_WORD(new_pc? new_pc-1:orig_gone-1); break;
-		case MAGIC_EVAL:	new_pc = plugin_eval(); PUSH_WORD(new_pc? new_pc-1:orig_eval-1); break;
-		
-		case MAGIC_CONTINUATION: /*printf("--CONTINUATION--\n");*/ return 0;
+/*
+ * All entry points are trapped on opcode fetch. A handler returns 1 to
+ * make the caller continue after the JSR, 0 if the 6502 should carry on
+ * at the trapped address.
+ */
+#define KERNAL_TRAP(f) static int f##_trap(void) { f(); return 1; }
+KERNAL_TRAP(SETMSG)
+KERNAL_TRAP(MEMTOP)
+KERNAL_TRAP(MEMBOT)
+KERNAL_TRAP(READST)
+KERNAL_TRAP(SETLFS)
+KERNAL_TRAP(SETNAM)
+KERNAL_TRAP(OPEN)
+KERNAL_TRAP(CLOSE)
+KERNAL_TRAP(CHKIN)
+KERNAL_TRAP(CHKOUT)
+KERNAL_TRAP(CLRCHN)
+KERNAL_TRAP(CHRIN)
+KERNAL_TRAP(CHROUT)
+KERNAL_TRAP(LOAD)
+KERNAL_TRAP(SAVE)
+KERNAL_TRAP(SETTIM)
+KERNAL_TRAP(RDTIM)
+KERNAL_TRAP(STOP)
+KERNAL_TRAP(GETIN)
+KERNAL_TRAP(CLALL)
+KERNAL_TRAP(PLOT)
+KERNAL_TRAP(IOBASE)
+
+static int plugin_off_trap(void) { plugin_off(); S+=2; return 1; }
+static int plugin_on_trap(void) { plugin_on(); S+=2; return 1; }
+
+#define MAGIC_TRAP(f, orig) static int f##_trap(void) { unsigned short new_pc = f(); PUSH_WORD(new_pc? new_pc-1:orig-1); return 1; }
+MAGIC_TRAP(plugin_error, orig_error)
+MAGIC_TRAP(plugin_main, orig_main)
+MAGIC_TRAP(plugin_crnch, orig_crnch)
+MAGIC_TRAP(plugin_qplop, orig_qplop)
+MAGIC_TRAP(plugin_gone, orig_gone)
+MAGIC_TRAP(plugin_eval, orig_eval)
+
+static int continuation_trap(void) { /*printf("--CONTINUATION--\n");*/ return 0; }
+
+static const struct {
+	unsigned short address;
+	trap_handler handler;
+} kernal_traps[] = {
+	{ 0xFF90, SETMSG_trap },
+	{ 0xFF99, MEMTOP_trap },
+	{ 0xFF9C, MEMBOT_trap },
+	{ 0xFFB7, READST_trap },
+	{ 0xFFBA, SETLFS_trap },
+	{ 0xFFBD, SETNAM_trap },
+	{ 0xFFC0, OPEN_trap },
+	{ 0xFFC3, CLOSE_trap },
+	{ 0xFFC6, CHKIN_trap },
+	{ 0xFFC9, CHKOUT_trap },
+	{ 0xFFCC, CLRCHN_trap },
+	{ 0xFFCF, CHRIN_trap },
+	{ 0xFFD2, CHROUT_trap },
+	{ 0xFFD5, LOAD_trap },
+	{ 0xFFD8, SAVE_trap },
+	{ 0xFFDB, SETTIM_trap },
+	{ 0xFFDE, RDTIM_trap },
+	{ 0xFFE1, STOP_trap },
+	{ 0xFFE4, GETIN_trap },
+	{ 0xFFE7, CLALL_trap },
+	{ 0xFFF0, PLOT_trap },
+	{ 0xFFF3, IOBASE_trap },
+
+	{ 0x0000, plugin_off_trap },
+	{ 0x0001, plugin_on_trap },
+
+	{ MAGIC_ERROR, plugin_error_trap },
+	{ MAGIC_MAIN, plugin_main_trap },
+	{ MAGIC_CRNCH, plugin_crnch_trap },
+	{ MAGIC_QPLOP, plugin_qplop_trap },
+	{ MAGIC_GONE, plugin_gone_trap },
+	{ MAGIC_EVAL, plugin_eval_trap },
+
+	{ MAGIC_CONTINUATION, continuation_trap },
+};
 
-#if 0
-		default: printf("unknown PC=$%04X S=$%02X\n", PC, S); exit(1);
-#else
-		default: return 1;
-#endif
-	}
-	return 1;
+void
+kernal_register_traps(void) {
+	for (int i = 0; i < sizeof(kernal_traps)/sizeof(*kernal_traps); i++)
+		register_trap(kernal_traps[i].address, kernal_traps[i].handler);
 }
-
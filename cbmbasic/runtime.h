@@ -1 +1,2 @@
+int init_os(int argc, char **argv);
 void handle_monitor(void *state);
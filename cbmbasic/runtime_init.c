@@ -3,11 +3,19 @@
 #include <time.h>
 
 #include "../perfect6502.h"
-/* XXX hook up memory[] with RAM[] in runtime.c */
+#include "runtime_init.h"
+#include "hle_math.h"
 
 extern int benchmark_mode;
+extern int fast_traps;
+extern int hle_math;
+extern unsigned int memo_entries;
+extern unsigned int trace_entries;
+extern int bitmap_scheduler;
+extern unsigned int group_entries;
 extern unsigned long cycle;
 static clock_t benchmark_start_time;
+static void *monitor_state;
  
 /************************************************************
  *
@@ -15,13 +23,84 @@ static clock_t benchmark_start_time;
  *
  ************************************************************/
 
-extern int kernal_dispatch(void);
-
 /* imported by runtime.c */
 unsigned char A, X, Y, S, P;
 unsigned short PC;
 int N, Z, C;
 
+/************************************************************
+ *
+ * Traps
+ *
+ ************************************************************/
+
+/*
+ * Traps fire when the 6502 fetches an opcode from their address. The
+ * bitmap makes the check on every fetch a single bit test, the handler
+ * is only looked up if it hits.
+ */
+#define MAX_TRAPS 64
+
+static unsigned int trap_bitmap[65536 / 32];
+
+static struct {
+	unsigned short address;
+	trap_handler handler;
+} traps[MAX_TRAPS];
+static int trapcount;
+
+static inline int
+is_trap(unsigned short address)
+{
+	return (trap_bitmap[address >> 5] >> (address & 31)) & 1;
+}
+
+void
+register_trap(unsigned short address, trap_handler handler)
+{
+	int i;
+	for (i = 0; i < trapcount; i++)
+		if (traps[i].address == address)
+			break;
+	if (i == trapcount) {
+		if (trapcount == MAX_TRAPS) {
+			fprintf(stderr, "Too many traps\n");
+			exit(1);
+		}
+		trapcount++;
+	}
+	traps[i].address = address;
+	traps[i].handler = handler;
+	trap_bitmap[address >> 5] |= 1U << (address & 31);
+}
+
+void
+unregister_trap(unsigned short address)
+{
+	for (int i = 0; i < trapcount; i++) {
+		if (traps[i].address == address) {
+			traps[i] = traps[--trapcount];
+			trap_bitmap[address >> 5] &= ~(1U << (address & 31));
+			return;
+		}
+	}
+}
+
+static trap_handler
+find_trap(unsigned short address)
+{
+	for (int i = 0; i < trapcount; i++)
+		if (traps[i].address == address)
+			return traps[i].handler;
+	return NULL;
+}
+
+/************************************************************
+ *
+ * Monitor
+ *
+ ************************************************************/
+
 int
 init_monitor()
 {
@@ -65,15 +144,27 @@ init_monitor()
 	
 	memory[0xfffc] = 0x00;
 	memory[0xfffd] = 0xF0;
+
+	kernal_register_traps();
+	if (hle_math)
+		hle_math_register_traps();
+	rehashMemory();
 	return 0;
 }
 
 void
 handle_monitor(void *state)
 {
-	PC = readPC(state);
+	monitor_state = state;
+
+	/* traps only fire on opcode fetches */
+	if (!readSYNC(state))
+		return;
+	unsigned short pc = readAddressBus(state);
+	if (!is_trap(pc))
+		return;
 
-	if (PC == 0xFFCF && benchmark_mode) {
+	if (pc == 0xFFCF && benchmark_mode) {
 		clock_t end_time = clock();
 		double elapsed_time = (double)(end_time - benchmark_start_time) / CLOCKS_PER_SEC;
 		double cycles_per_sec = cycle / elapsed_time;
@@ -82,49 +173,123 @@ handle_monitor(void *state)
 		printf("  Half-cycles: %lu\n", cycle);
 		printf("  Time: %.3f seconds\n", elapsed_time);
 		printf("  Performance: %.0f cycles/sec\n", cycles_per_sec);
+		if (hle_math)
+			printf("  HLE math: on, %lu calls\n", hle_math_calls);
+		else
+			printf("  HLE math: off\n");
+		printf("  Scheduler: %s, %lu iterations\n", bitmap_scheduler ? "bitmap" : "list", readIterations(state));
+		printf("  Kernels: %s, node layout: %s\n", readKernels(state), readNodeLayout(state));
+		{
+			unsigned long saved, hits, misses;
+			readGroupStats(state, &saved, &hits, &misses);
+			printf("  Floods saved: %lu\n", saved);
+			if (group_entries)
+				printf("  Group cache: %lu hits, %lu misses\n", hits, misses);
+		}
+		if (memo_entries) {
+			unsigned long hits, misses;
+			readMemoStats(state, &hits, &misses);
+			printf("  Memo cache: %lu hits, %lu misses\n", hits, misses);
+		}
+		if (trace_entries) {
+			unsigned long hits, misses;
+			readTraceStats(state, &hits, &misses);
+			printf("  Traces: %lu hits, %lu misses\n", hits, misses);
+		}
 		chipStatus(state);
 		exit(0);
 	}
 
-	if (PC >= 0xFF90 && ((PC - 0xFF90) % 3 == 0)) {
-		/* get register status out of 6502 */
-		A = readA(state);
-		X = readX(state);
-		Y = readY(state);
-		S = readSP(state);
-		P = readP(state);
-		N = P >> 7;
-		Z = (P >> 1) & 1;
-		C = P & 1;
+	/* get register status out of 6502 */
+	A = readA(state);
+	X = readX(state);
+	Y = readY(state);
+	S = readSP(state);
+	P = readP(state);
+	N = P >> 7;
+	Z = (P >> 1) & 1;
+	C = P & 1;
 
-		kernal_dispatch();
+	/* handlers and the return stub below write RAM directly */
+	rehashMemory();
+	PC = pc;
+	if (!find_trap(pc)())
+		return;
 
-		/* encode processor status */
-		P &= 0x7C; /* clear N, Z, C */
-		P |= (N << 7) | (Z << 1) | C;
+	/* encode processor status */
+	P &= 0x7C; /* clear N, Z, C */
+	P |= (N << 7) | (Z << 1) | C;
 
+	if (fast_traps || pc < 0xFF90) {
 		/*
-		 * all KERNAL calls make the 6502 jump to $F800, so we
-		 * put code there that loads the return state of the
-		 * KERNAL function and returns to the caller
-		 */
-		memory[0xf800] = 0xA9; /* LDA #P */
-		memory[0xf801] = P;
-		memory[0xf802] = 0x48; /* PHA    */
-		memory[0xf803] = 0xA9; /* LHA #A */
-		memory[0xf804] = A;
-		memory[0xf805] = 0xA2; /* LDX #X */
-		memory[0xf806] = X;
-		memory[0xf807] = 0xA0; /* LDY #Y */
-		memory[0xf808] = Y;
-		memory[0xf809] = 0x28; /* PLP    */
-		memory[0xf80a] = 0x60; /* RTS    */
-		/*
-		 * XXX we could do RTI instead of PLP/RTS, but RTI seems to be
-		 * XXX broken in the chip dump - after the KERNAL call at 0xFF90,
-		 * XXX the 6502 gets heavily confused about its program counter
-		 * XXX and executes garbage instructions
+		 * load the return state straight into the registers
+		 * and do the RTS ourselves: the chip is about to fetch
+		 * the opcode at the trap address, so it is at an
+		 * instruction boundary; traps outside the KERNAL jump
+		 * table always return this way
 		 */
+		unsigned short ret = memory[0x0100 | (unsigned char)(S + 1)] |
+			memory[0x0100 | (unsigned char)(S + 2)] << 8;
+		writeRegisters(state, A, X, Y, S + 2, P, ret + 1);
+		return;
 	}
+
+	/*
+	 * all KERNAL calls make the 6502 jump to $F800, so we
+	 * put code there that loads the return state of the
+	 * KERNAL function and returns to the caller
+	 */
+	memory[0xf800] = 0xA9; /* LDA #P */
+	memory[0xf801] = P;
+	memory[0xf802] = 0x48; /* PHA    */
+	memory[0xf803] = 0xA9; /* LHA #A */
+	memory[0xf804] = A;
+	memory[0xf805] = 0xA2; /* LDX #X */
+	memory[0xf806] = X;
+	memory[0xf807] = 0xA0; /* LDY #Y */
+	memory[0xf808] = Y;
+	memory[0xf809] = 0x28; /* PLP    */
+	memory[0xf80a] = 0x60; /* RTS    */
+	/*
+	 * XXX we could do RTI instead of PLP/RTS, but RTI seems to be
+	 * XXX broken in the chip dump - after the KERNAL call at 0xFF90,
+	 * XXX the 6502 gets heavily confused about its program counter
+	 * XXX and executes garbage instructions
+	 */
 }
 
+/*
+ * Run 6502 code on behalf of a trap handler: the chip continues at pc
+ * with the current register values, and we return once it fetches from
+ * ret, i.e. the code has returned to the address the caller pushed.
+ * Traps keep firing in the meantime; PC is the caller's trap address
+ * again afterwards.
+ */
+void
+monitor_call(unsigned short pc, unsigned short ret)
+{
+	void *state = monitor_state;
+	unsigned short trap_pc = PC;
+
+	P &= 0x7C; /* clear N, Z, C */
+	P |= (N << 7) | (Z << 1) | C;
+	writeRegisters(state, A, X, Y, S, P, pc);
+	for (;;) {
+		step(state);
+		step(state);
+		if (readSYNC(state) && readAddressBus(state) == ret)
+			break;
+		handle_monitor(state);
+	}
+
+	/* the last instruction was an RTS, so the registers are settled */
+	A = readA(state);
+	X = readX(state);
+	Y = readY(state);
+	S = readSP(state);
+	P = readP(state);
+	N = P >> 7;
+	Z = (P >> 1) & 1;
+	C = P & 1;
+	PC = trap_pc;
+}
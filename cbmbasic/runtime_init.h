@@ -1 +1,8 @@
 int init_monitor();
+
+typedef int (*trap_handler)(void);
+
+void register_trap(unsigned short address, trap_handler handler);
+void unregister_trap(unsigned short address);
+void kernal_register_traps(void);
+void monitor_call(unsigned short pc, unsigned short ret);
@@ -1,171 +1,635 @@
+/*
+ * Compare the functional 6502 (cbmbasic/emu.c) against the
+ * transistor simulation:
+ *
+ * 1. every documented opcode with random registers and memory,
+ *    comparing all bus cycles and the resulting registers
+ * 2. the CBM BASIC ROM, instruction by instruction in lockstep
+ * 3. the CBM BASIC ROM, handing off between both cores, which has
+ *    to end up in the same state as running on transistors only
+ * 4. a count loop and the CBM BASIC ROM with the options that must
+ *    not change the results, which have to end up in the same state
+ *    (chipStateHash()) as the plain chip, or at least with the same
+ *    registers and memory, and the part of the hash that covers memory
+ * 5. IRQs scheduled with schedulePin(), which have to enter the
+ *    handler in the cycle the 6502 takes them in, event queues that
+ *    belong to one chip each, and a polling loop released by events,
+ *    which has to end in the same state with loop skipping
+ */
 
-void
-full_step(uint16_t *a, uint8_t *d, BOOL *r_w)
-{
-	step();
-	step();
-
-	*a = readAddressBus();
-	*d = readDataBus();
-	*r_w = isNodeHigh(rw);
-}
-
-#define RESET 0xF000
-#define A_OUT 0xF100
-#define X_OUT 0xF101
-#define Y_OUT 0xF102
-#define S_OUT 0xF103
-#define P_OUT 0xF104
-
-#define TRIGGER1 0x5555
-uint16_t trigger2;
-#define TRIGGER3 0xAAAA
-
-void
-setup_memory(int length, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t A, uint8_t X, uint8_t Y, uint8_t S, uint8_t P)
-{
-	bzero(memory, 65536);
-
-	memory[0xFFFC] = RESET & 0xFF;
-	memory[0xFFFD] = RESET >> 8;
-	memory[RESET + 0x00] = 0xA2; /* LDA #S */
-	memory[RESET + 0x01] = S;
-	memory[RESET + 0x02] = 0x9A; /* TXS    */
-	memory[RESET + 0x03] = 0xA9; /* LDA #P */
-	memory[RESET + 0x04] = P;
-	memory[RESET + 0x05] = 0x48; /* PHA    */
-	memory[RESET + 0x06] = 0xA9; /* LHA #A */
-	memory[RESET + 0x07] = A;
-	memory[RESET + 0x08] = 0xA2; /* LDX #X */
-	memory[RESET + 0x09] = X;
-	memory[RESET + 0x0A] = 0xA0; /* LDY #Y */
-	memory[RESET + 0x0B] = Y;
-	memory[RESET + 0x0C] = 0x28; /* PLP    */
-	memory[RESET + 0x0D] = 0x8D; /* STA TRIGGER1 */
-	memory[RESET + 0x0E] = TRIGGER1 & 0xFF;
-	memory[RESET + 0x0F] = TRIGGER1 >> 8;
-	memory[RESET + 0x10] = b1;
-	uint16_t addr = RESET + 0x11;
-	if (length >= 2)
-		memory[addr++] = b2;
-	if (length >= 3)
-		memory[addr++] = b3;
-	trigger2 = addr;
-	memory[addr++] = 0x08; /* PHP */
-	memory[addr++] = 0x8D; /* STA A_OUT */
-	memory[addr++] = A_OUT & 0xFF;
-	memory[addr++] = A_OUT >> 8;
-	memory[addr++] = 0x8E; /* STX X_OUT */
-	memory[addr++] = X_OUT & 0xFF;
-	memory[addr++] = X_OUT >> 8;
-	memory[addr++] = 0x8C; /* STY Y_OUT */
-	memory[addr++] = Y_OUT & 0xFF;
-	memory[addr++] = Y_OUT >> 8;
-	memory[addr++] = 0x68; /* PLA */
-	memory[addr++] = 0x8D; /* STA P_OUT */
-	memory[addr++] = P_OUT & 0xFF;
-	memory[addr++] = P_OUT >> 8;
-	memory[addr++] = 0xBA; /* TSX */
-	memory[addr++] = 0x8E; /* STX S_OUT */
-	memory[addr++] = S_OUT & 0xFF;
-	memory[addr++] = S_OUT >> 8;
-	memory[addr++] = 0x8D; /* STA TRIGGER3 */
-	memory[addr++] = TRIGGER3 & 0xFF;
-	memory[addr++] = TRIGGER3 >> 8;
-	memory[addr++] = 0xA9; /* LDA #$00  */
-	memory[addr++] = 0x00;
-	memory[addr++] = 0xF0; /* BEQ .     */
-	memory[addr++] = 0xFE;
-}
-
-#define IS_READ_CYCLE (isNodeHigh(clk0) && isNodeHigh(rw))
-#define IS_WRITE_CYCLE (isNodeHigh(clk0) && !isNodeHigh(rw))
-#define IS_READING(a) (IS_READ_CYCLE && readAddressBus() == (a))
-
-#define MAX_CYCLES 100
-
-enum {
-	STATE_BEFORE_INSTRUCTION,
-	STATE_DURING_INSTRUCTION,
-	STATE_FIRST_FETCH
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "perfect6502.h"
+#include "cbmbasic/emu.h"
+
+#define TRIALS 20
+#define DECIMAL_TRIALS 500
+#define LOCKSTEP_INSTRUCTIONS 20000
+#define HANDOFF_CYCLES 100000
+#define FUNCTIONAL_SLICE 3000 /* half-cycles */
+#define TRANSISTOR_SLICE 20   /* instructions */
+#define OPTION_INSTRUCTIONS 22000
+#define OPTION_SPLIT 2000     /* instructions before the "later" options */
+#define GROUP_CACHE_ENTRIES 4096
+#define TRACE_ENTRIES 4096
+#define ICACHE_ENTRIES 4096
+#define SNAPSHOT_INSTRUCTIONS 500 /* run and undone again */
+#define IRQ_DELAYS 16         /* half-cycles */
+#define POLL_RELEASES 4
+#define POLL_INTERVAL 5001    /* half-cycles between releases */
+#define POLL_LIMIT 1000       /* half-cycles skipped per instruction at most */
+
+static uint8_t emu_ram[65536];
+static int errors;
+
+static void
+print_instruction(const char *name, const instr_info *info)
+{
+	printf("  %-11s $%04X: %02X, %d cycles:", name, info->pc, info->opcode, info->cycles);
+	for (int i = 0; i < info->cycles && i < MAX_INSTR_CYCLES; i++)
+		printf(" %c%04X=%02X", info->bus[i].rw ? 'R' : 'W', info->bus[i].address, info->bus[i].data);
+	printf("\n");
+}
+
+static BOOL
+same_instruction(const instr_info *chip, const instr_info *emu)
+{
+	if (chip->pc != emu->pc || chip->opcode != emu->opcode || chip->cycles != emu->cycles)
+		return NO;
+	for (int i = 0; i < chip->cycles && i < MAX_INSTR_CYCLES; i++)
+		if (chip->bus[i].address != emu->bus[i].address ||
+			chip->bus[i].data != emu->bus[i].data ||
+			chip->bus[i].rw != emu->bus[i].rw)
+			return NO;
+	return YES;
+}
+
+static BOOL
+same_registers(const emu_registers *a, const emu_registers *b)
+{
+	return a->a == b->a && a->x == b->x && a->y == b->y &&
+		a->s == b->s && a->p == b->p && a->pc == b->pc;
+}
+
+static void
+print_registers(const char *name, const emu_registers *r)
+{
+	printf("  %-11s PC=%04X A=%02X X=%02X Y=%02X S=%02X P=%02X\n", name, r->pc, r->a, r->x, r->y, r->s, r->p);
+}
+
+static void
+error(const char *what, const instr_info *chip, const instr_info *emu)
+{
+	printf("%s\n", what);
+	print_instruction("transistors", chip);
+	print_instruction("functional", emu);
+	errors++;
+}
+
+/************************************************************
+ *
+ * Single Instructions
+ *
+ ************************************************************/
+
+/* the chip reaches the first opcode fetch after two "instructions" */
+static void
+finish_reset(void *state)
+{
+	instr_info info;
+
+	stepInstruction(state, &info);
+	stepInstruction(state, &info);
+}
+
+static BOOL
+is_documented(uint8_t opcode)
+{
+	instr_info info;
+	emu_registers r = { 0, 0, 0, 0xFF, 0, 0x0200 };
+
+	emu_memory = emu_ram;
+	memset(emu_ram, 0, sizeof(emu_ram));
+	emu_ram[0x0200] = opcode;
+	emu_set_registers(&r);
+	return emu_step_instruction(&info);
+}
+
+static void
+test_opcode(void *state, uint8_t opcode, int trials)
+{
+	for (int t = 0; t < trials; t++) {
+		instr_info chip, emu;
+		emu_registers r, r_chip, r_emu;
+
+		for (int i = 0; i < 65536; i++)
+			memory[i] = rand();
+		r.a = rand();
+		r.x = rand();
+		r.y = rand();
+		r.s = rand();
+		r.p = rand();
+		r.pc = rand();
+		memory[r.pc] = opcode;
+
+		emu_memory = memory;
+		emu_set_registers(&r);
+		emu_to_chip(state);
+
+		memcpy(emu_ram, memory, sizeof(emu_ram));
+		emu_memory = emu_ram;
+		stepInstruction(state, &chip);
+		emu_step_instruction(&emu);
+
+		if (!same_instruction(&chip, &emu)) {
+			print_registers("before", &r);
+			error("bus cycles differ", &chip, &emu);
+			return;
+		}
+
+		emu_get_registers(&r_emu);
+		emu_from_chip(state);
+		emu_get_registers(&r_chip);
+		if (!same_registers(&r_chip, &r_emu)) {
+			printf("registers differ\n");
+			print_registers("before", &r);
+			print_registers("transistors", &r_chip);
+			print_registers("functional", &r_emu);
+			print_instruction("", &chip);
+			errors++;
+			return;
+		}
+	}
+}
+
+static void
+test_opcodes(void *state)
+{
+	int count = 0;
+
+	printf("testing opcodes...\n");
+	memset(memory, 0, 65536);
+	finish_reset(state);
+	for (int opcode = 0x00; opcode <= 0xFF; opcode++) {
+		if (!is_documented(opcode))
+			continue;
+		/* ADC and SBC get more trials for decimal mode */
+		BOOL decimal = (opcode & 0x03) == 0x01 && ((opcode & 0xE0) == 0x60 || (opcode & 0xE0) == 0xE0);
+		test_opcode(state, opcode, decimal ? DECIMAL_TRIALS : TRIALS);
+		count++;
+	}
+	printf("%d opcodes tested\n", count);
+}
+
+/************************************************************
+ *
+ * Programs
+ *
+ ************************************************************/
+
+static void
+setup_basic()
+{
+	FILE *f = fopen("cbmbasic/cbmbasic.bin", "rb");
+	if (f == NULL) {
+		perror("Error opening cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+	memset(memory, 0, 65536);
+	size_t readlen = fread(memory + 0xA000, 1, 17591, f);
+	fclose(f);
+	if (readlen != 17591) {
+		perror("Error reading cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+
+	/* KERNAL calls just return */
+	for (unsigned short addr = 0xFF90; addr < 0xFFF3; addr += 3)
+		memory[addr] = 0x60; /* RTS */
+
+	/* like cbmbasic, RESET jumps to $F000 which calls the cold start */
+	memory[0xF000] = 0x20;
+	memory[0xF001] = 0x94;
+	memory[0xF002] = 0xE3;
+	memory[0xFFFC] = 0x00;
+	memory[0xFFFD] = 0xF0;
+}
+
+static void
+test_lockstep(void *state)
+{
+	instr_info chip, emu;
+
+	printf("running BASIC in lockstep...\n");
+	setup_basic();
+	memcpy(emu_ram, memory, sizeof(emu_ram));
+
+	/* the RESET sequence is not emulated */
+	finish_reset(state);
+	emu_memory = memory;
+	emu_from_chip(state);
+	emu_to_chip(state);
+	emu_memory = emu_ram;
+
+	for (int i = 0; i < LOCKSTEP_INSTRUCTIONS; i++) {
+		stepInstruction(state, &chip);
+		emu_step_instruction(&emu);
+		if (!same_instruction(&chip, &emu)) {
+			error("bus cycles differ", &chip, &emu);
+			return;
+		}
+	}
+	printf("%d instructions compared\n", LOCKSTEP_INSTRUCTIONS);
+}
+
+static void
+run_basic(void *state, BOOL hybrid)
+{
+	instr_info info;
+	emu_trigger trigger;
+
+	setup_basic();
+	finish_reset(state);
+	emu_memory = memory;
+
+	trigger.pc = -1;
+	trigger.access_lo = 1;
+	trigger.access_hi = 0;
+	while (cycle < HANDOFF_CYCLES) {
+		if (hybrid) {
+			emu_from_chip(state);
+			trigger.cycle = cycle + FUNCTIONAL_SLICE;
+			if (trigger.cycle > HANDOFF_CYCLES)
+				trigger.cycle = HANDOFF_CYCLES;
+			emu_run(state, &trigger);
+			emu_to_chip(state);
+		}
+		for (int i = 0; i < TRANSISTOR_SLICE && cycle < HANDOFF_CYCLES; i++)
+			stepInstruction(state, &info);
+	}
+}
+
+static void
+test_handoff(void *state)
+{
+	static uint8_t expected[65536];
+	emu_registers r_chip, r_hybrid;
+	unsigned long chip_cycle;
+
+	printf("running BASIC with hand-offs...\n");
+	run_basic(state, NO);
+	emu_from_chip(state);
+	emu_get_registers(&r_chip);
+	memcpy(expected, memory, sizeof(expected));
+	chip_cycle = cycle;
+
+	destroyChip(state);
+	state = initAndResetChip();
+	run_basic(state, YES);
+	emu_from_chip(state);
+	emu_get_registers(&r_hybrid);
+
+	if (cycle != chip_cycle || !same_registers(&r_chip, &r_hybrid) || memcmp(expected, memory, sizeof(expected))) {
+		printf("hybrid run differs: cycle %lu/%lu\n", chip_cycle, cycle);
+		print_registers("transistors", &r_chip);
+		print_registers("hybrid", &r_hybrid);
+		errors++;
+		return;
+	}
+	printf("%lu half-cycles compared\n", cycle);
+	destroyChip(state);
+}
+
+/************************************************************
+ *
+ * Options
+ *
+ ************************************************************/
+
+typedef struct {
+	const char *name;
+	void (*start)(void *state);     /* after reset */
+	void (*later)(void *state);     /* after OPTION_SPLIT instructions */
+	BOOL exact;                     /* NO: nodes that gate nothing may keep other charges */
+} option;
+
+typedef struct {
+	unsigned long long hash;
+	unsigned long cycle;
+	emu_registers r;
+	uint8_t memory[65536];
+} outcome;
+
+static void group_cache(void *state) { setGroupCache(state, GROUP_CACHE_ENTRIES); }
+static void tie_pins(void *state) { tieControlPins(state); }
+static void bitmap_scheduler(void *state) { setBitmapScheduler(state, YES); }
+static void traces(void *state) { setTraceCache(state, TRACE_ENTRIES); }
+static void icache(void *state) { setInstructionCache(state, ICACHE_ENTRIES); }
+
+/* go ahead, then back to a snapshot, with memory and cycle from the host */
+static void
+snapshot(void *state)
+{
+	static uint8_t saved_memory[65536];
+	unsigned long saved_cycle = cycle;
+	void *buf = malloc(chipStateSize(state));
+	instr_info info;
+
+	saveChipState(state, buf);
+	memcpy(saved_memory, memory, sizeof(saved_memory));
+	for (int i = 0; i < SNAPSHOT_INSTRUCTIONS; i++)
+		stepInstruction(state, &info);
+	restoreChipState(state, buf);
+	memcpy(memory, saved_memory, sizeof(saved_memory));
+	cycle = saved_cycle;
+	rehashMemory();
+	free(buf);
+}
+
+static const option options[] = {
+	{ "group cache", group_cache, NULL, YES },
+	{ "tied pins", NULL, tie_pins, YES },
+	{ "group cache, tied pins", group_cache, tie_pins, YES },
+	{ "traces", traces, NULL, YES },
+	{ "traces, tied pins", traces, tie_pins, YES },
+	{ "instruction cache", icache, NULL, YES },
+	{ "instruction cache, later", NULL, icache, YES },
+	{ "snapshot", NULL, snapshot, YES },
+	/* floating nodes are left with the charge of the last group they were in */
+	{ "bitmap scheduler", bitmap_scheduler, NULL, NO },
 };
 
-void
-setup_perfect()
+/* INX, TXA, STA $10,X forever */
+static void
+setup_count_loop()
 {
-	setupNodesAndTransistors();
-	verbose = 0;
+	static const uint8_t program[] = { 0xA2, 0x00, 0xE8, 0x8A, 0x95, 0x10, 0x4C, 0x02, 0x02 };
+
+	memset(memory, 0, 65536);
+	memcpy(memory + 0x0200, program, sizeof(program));
+	memory[0xFFFC] = 0x00;
+	memory[0xFFFD] = 0x02;
 }
 
-uint16_t instr_ab[10];
-uint8_t instr_db[10];
-BOOL instr_rw[10];
+static void
+run_option(void (*setup)(void), const option *o, outcome *out)
+{
+	instr_info info;
+	void *state;
 
-int
-perfect_measure_instruction()
-{
-	int state = STATE_BEFORE_INSTRUCTION;
-	int c = 0;
-	for (int i = 0; i < MAX_CYCLES; i++) {
-		uint16_t ab;
-		uint8_t db;
-		BOOL r_w;
-		full_step(&ab, &db, &r_w);
-
-		if (state == STATE_DURING_INSTRUCTION && ab > trigger2) {
-			/*
-			 * we see the FIRST fetch of the next instruction,
-			 * the test instruction MIGHT be done
-			 */
-			state = STATE_FIRST_FETCH;
-		} 
-
-		if (state == STATE_DURING_INSTRUCTION) {
-			instr_rw[c] = r_w;
-			instr_ab[c] = ab;
-			instr_db[c] = db;
-			c++;
+	setup();
+	state = initAndResetChip();
+	if (o && o->start)
+		o->start(state);
+	for (int i = 0; i < OPTION_INSTRUCTIONS; i++) {
+		if (i == OPTION_SPLIT && o && o->later)
+			o->later(state);
+		stepInstruction(state, &info);
+	}
+	out->hash = chipStateHash(state);
+	out->cycle = cycle;
+	emu_memory = memory;
+	emu_from_chip(state);
+	emu_get_registers(&out->r);
+	memcpy(out->memory, memory, sizeof(out->memory));
+	if (o)
+		printf("  %-24s %016llX PC=%04X A=%02X X=%02X\n", o->name, out->hash, out->r.pc, out->r.a, out->r.x);
+	destroyChip(state);
+}
+
+static void
+test_options(const char *name, void (*setup)(void))
+{
+	static outcome expected, got;
+
+	printf("running %s with options...\n", name);
+	run_option(setup, NULL, &expected);
+	for (int i = 0; i < sizeof(options) / sizeof(*options); i++) {
+		run_option(setup, &options[i], &got);
+		if (options[i].exact ? got.hash != expected.hash :
+			got.cycle != expected.cycle || !same_registers(&got.r, &expected.r) ||
+			memcmp(got.memory, expected.memory, sizeof(got.memory))) {
+			printf("%s differs with %s\n", name, options[i].name);
+			errors++;
 		}
+	}
+}
+
+/*
+ * Writes by the chip keep the memory hash up to date, and so does
+ * rehashMemory() after the host writes memory[] directly.
+ */
+static void
+test_memory_hash()
+{
+	instr_info info;
+	unsigned long long before, after;
+	void *state;
 
-		if (ab == TRIGGER1) {
-			state = STATE_DURING_INSTRUCTION; /* we're done writing the trigger value; now comes the instruction! */
-		} 
-		if (ab == TRIGGER3) {
-			break; /* we're done dumping the CPU state */
+	printf("testing the memory hash...\n");
+	setup_count_loop();
+	state = initAndResetChip();
+	for (int i = 0; i < OPTION_SPLIT; i++)
+		stepInstruction(state, &info);
+	before = chipStateHash(state);
+	rehashMemory();
+	if (chipStateHash(state) != before) {
+		printf("memory hash out of date after writes by the chip\n");
+		errors++;
+	}
+
+	memory[0x1234] ^= 0xFF;
+	rehashMemory();
+	after = chipStateHash(state);
+	memory[0x1234] ^= 0xFF;
+	rehashMemory();
+	if (after == before || chipStateHash(state) != before) {
+		printf("memory hash does not follow writes by the host\n");
+		errors++;
+	}
+	destroyChip(state);
+}
+
+/************************************************************
+ *
+ * Events
+ *
+ ************************************************************/
+
+/* CLI, then NOPs, with an RTI at the IRQ vector */
+static void
+setup_nops()
+{
+	memset(memory, 0xEA, 65536);
+	memory[0x0200] = 0x58;
+	memory[0x0300] = 0x40;
+	memory[0xFFFC] = 0x00;
+	memory[0xFFFD] = 0x02;
+	memory[0xFFFE] = 0x00;
+	memory[0xFFFF] = 0x03;
+}
+
+static void
+record_cycle(void *state, void *context)
+{
+	*(unsigned long *)context = cycle;
+}
+
+/*
+ * The 6502 looks at IRQ before the last cycle of an instruction: a NOP
+ * (2 cycles) takes an IRQ that went low before its second cycle, and
+ * the 7 cycles of the interrupt sequence follow it.
+ */
+static void
+test_events()
+{
+	instr_info info;
+	void *state, *other;
+
+	printf("testing scheduled IRQs...\n");
+	for (int n = 0; n < IRQ_DELAYS; n++) {
+		unsigned long start, called = 0, entered = 0;
+
+		setup_nops();
+		state = initAndResetChip();
+		finish_reset(state);
+		/* CLI only lets IRQs in after the instruction that follows it */
+		for (int i = 0; i < 3; i++)
+			stepInstruction(state, &info);
+
+		/* a NOP starts now, they take 4 half-cycles each */
+		start = cycle;
+		schedulePin(state, start + n, PIN_IRQ, 0);
+		schedulePin(state, start + n + 12, PIN_IRQ, 1);
+		scheduleCallback(state, start + n, record_cycle, &called);
+		if (nextEventCycle(state) != start + n) {
+			printf("next event at %lu instead of %lu\n", nextEventCycle(state), start + n);
+			errors++;
+		}
+		for (int i = 0; i < 2 * IRQ_DELAYS && !entered; i++) {
+			unsigned long before = cycle;
+			stepInstruction(state, &info);
+			if (info.pc == 0x0300)
+				entered = before - start;
 		}
+
+		unsigned long taken = (n + 2) / 4 * 4;
+		if (entered != taken + 4 + 14 || called != start + n) {
+			printf("IRQ at +%d: handler at +%lu instead of +%lu, callback at %lu instead of %lu\n",
+				n, entered, taken + 4 + 14, called, start + n);
+			errors++;
+		}
+		destroyChip(state);
+	}
+
+	/* a second chip has its own queue */
+	setup_nops();
+	state = initAndResetChip();
+	schedulePin(state, 1000, PIN_IRQ, 0);
+	other = initAndResetChip();
+	if (nextEventCycle(other) != ~0UL || nextEventCycle(state) != 1000) {
+		printf("event queues are shared between chips\n");
+		errors++;
+	}
+	destroyChip(other);
+	destroyChip(state);
+	printf("%d IRQ delays tested\n", IRQ_DELAYS);
+}
+
+/* LDX #0; wait for $10 to be set, INX, STX $11, clear $10, wait again */
+static void
+setup_poll_loop()
+{
+	static const uint8_t program[] = {
+		0xA2, 0x00, 0xA5, 0x10, 0xF0, 0xFC, 0xE8, 0x86, 0x11,
+		0xA9, 0x00, 0x85, 0x10, 0x4C, 0x02, 0x02
 	};
 
-	return c;
+	memset(memory, 0, 65536);
+	memcpy(memory + 0x0200, program, sizeof(program));
+	memory[0xFFFC] = 0x00;
+	memory[0xFFFD] = 0x02;
 }
 
-extern void setup_emu(void);
-void reset_emu(void);
-extern int emu_measure_instruction(void);
+/* the host writes memory behind the chip's back */
+static void
+release_poll(void *state, void *context)
+{
+	memory[0x10] = 1;
+	rehashMemory();
+}
+
+static void
+run_poll_loop(unsigned long limit, outcome *out)
+{
+	instr_info info;
+	void *state;
+
+	setup_poll_loop();
+	state = initAndResetChip();
+	setLoopSkipping(state, limit);
+	/* the last one is never seen, it only keeps the skip from running past the end */
+	for (int i = 1; i <= POLL_RELEASES + 1; i++)
+		scheduleCallback(state, i * POLL_INTERVAL, release_poll, NULL);
+	while (cycle < (POLL_RELEASES + 1) * POLL_INTERVAL)
+		stepInstruction(state, &info);
+	out->hash = chipStateHash(state);
+	out->cycle = cycle;
+	memcpy(out->memory, memory, sizeof(out->memory));
+	destroyChip(state);
+}
+
+/*
+ * Skipping stops at the next event and always lands on the start of an
+ * iteration, where the plain chip is too, so both have to reach the
+ * same instruction boundaries after every release.
+ */
+static void
+test_loop_skipping()
+{
+	static outcome expected, got;
+	unsigned long skipped = skipped_cycles;
+
+	printf("running a polling loop with loop skipping...\n");
+	run_poll_loop(0, &expected);
+	run_poll_loop(POLL_LIMIT, &got);
+	skipped = skipped_cycles - skipped;
+	if (got.hash != expected.hash || got.cycle != expected.cycle ||
+		memcmp(got.memory, expected.memory, sizeof(got.memory)) ||
+		got.memory[0x11] != POLL_RELEASES || !skipped) {
+		printf("loop skipping: %016llX at %lu, $11=%d instead of %016llX at %lu, $11=%d\n",
+			got.hash, got.cycle, got.memory[0x11], expected.hash, expected.cycle, expected.memory[0x11]);
+		errors++;
+	}
+	printf("%lu of %lu half-cycles skipped\n", skipped, got.cycle);
+}
 
 int
 main()
 {
-	setup_perfect();
-//	setup_memory(1, 0xEA, 0x00, 0x00, 0, 0, 0, 0, 0);
-//	setup_memory(2, 0xA9, 0x00, 0x00, 0, 0, 0, 0, 0);
-//	setup_memory(2, 0xAD, 0x00, 0x10, 0, 0, 0, 0, 0);
-//	setup_memory(3, 0xFE, 0x00, 0x10, 0, 0, 0, 0, 0);
-//	setup_memory(3, 0x9D, 0xFF, 0x10, 0, 2, 0, 0, 0);
-	setup_memory(1, 0x28, 0x00, 0x00, 0x55, 0, 0, 0x80, 0);
-	resetChip();
-	int instr_cycles = perfect_measure_instruction();
-
-	for (int c = 0; c < instr_cycles; c++ ) {
-		printf("T%d ", c+1);
-		if (instr_rw[c])
-			printf("R $%04X\n", instr_ab[c]);
-		else
-			printf("W $%04X = $%02X\n", instr_ab[c], instr_db[c]);
-	}
+	void *state;
+
+	state = initAndResetChip();
+	test_opcodes(state);
+	destroyChip(state);
+
+	state = initAndResetChip();
+	test_lockstep(state);
+	destroyChip(state);
+
+	state = initAndResetChip();
+	test_handoff(state);
+
+	test_options("count loop", setup_count_loop);
+	test_options("BASIC", setup_basic);
+	test_memory_hash();
 
-	setup_emu();
-	setup_memory(1, 0x48, 0x00, 0x00, 0x55, 0, 0, 0x80, 0);
-	reset_emu();
-	int instr_cycles2 = emu_measure_instruction();
+	test_events();
+	test_loop_skipping();
 
+	printf("%d errors\n", errors);
+	return errors != 0;
 }
@@ -0,0 +1,233 @@
+/*
+ * Compare the HLE versions of the BASIC floating point routines
+ * (cbmbasic/hle_math.c) against the ROM code, run on the functional
+ * 6502 (cbmbasic/emu.c, which compare.c checks against the transistors):
+ *
+ * 1. FADD, FMULT and FDIV and their ARG entry points, computed in C
+ * 2. SQR, LOG, EXP and SIN, whose series run on the functional core
+ *
+ * Both start from the same random FAC, ARG and operand. Where the HLE
+ * version handles a call, the registers, the flags and all memory
+ * (except the stack below the return address) have to be the same as
+ * after the ROM code. Where it gives up (overflow, division by zero,
+ * errors), memory has to be unchanged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "perfect6502.h"
+#include "cbmbasic/runtime_init.h"
+#include "cbmbasic/emu.h"
+#include "cbmbasic/hle_math.h"
+
+#define ARITHMETIC_TRIALS 20000
+#define FUNCTION_TRIALS 2000
+#define MAX_INSTRUCTIONS 1000000
+#define STOP 0x0400             /* where the routines return to */
+#define OPERAND 0x0300          /* the (A/Y) operand */
+
+/* the registers at a trap, normally in cbmbasic/runtime_init.c */
+unsigned char A, X, Y, S, P;
+unsigned short PC;
+int N, Z, C;
+
+static trap_handler handlers[65536];
+
+void
+register_trap(unsigned short address, trap_handler handler)
+{
+	handlers[address] = handler;
+}
+
+static uint8_t before[65536];
+static uint8_t after[65536];
+static int errors;
+
+static void
+setup_basic()
+{
+	FILE *f = fopen("cbmbasic/cbmbasic.bin", "rb");
+	if (f == NULL) {
+		perror("Error opening cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+	memset(memory, 0, 65536);
+	size_t readlen = fread(memory + 0xA000, 1, 17591, f);
+	fclose(f);
+	if (readlen != 17591) {
+		perror("Error reading cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+}
+
+/* run a ROM routine up to its RTS to STOP; NO on BASIC errors */
+static BOOL
+rom(unsigned short address, emu_registers *r)
+{
+	instr_info info;
+
+	memory[0x100 | r->s] = (STOP - 1) >> 8;
+	memory[0x100 | (uint8_t)(r->s - 1)] = (STOP - 1) & 0xFF;
+	r->s -= 2;
+	r->pc = address;
+	emu_memory = memory;
+	emu_set_registers(r);
+	for (int i = 0; i < MAX_INSTRUCTIONS; i++) {
+		emu_get_registers(r);
+		if (r->pc == STOP)
+			return YES;
+		if (r->pc == 0xA437 || !emu_step_instruction(&info))
+			return NO;
+	}
+	return NO;
+}
+
+/* a random floating point number, mostly of moderate size */
+static void
+random_float(uint8_t *f)
+{
+	if (!(rand() % 16))
+		f[0] = 0;
+	else if (!(rand() % 8))
+		f[0] = rand();
+	else
+		f[0] = 0x78 + rand() % 16;
+	f[1] = rand() | 0x80;
+	f[2] = rand();
+	f[3] = rand();
+	f[4] = rand();
+	f[5] = rand() & 1 ? 0xFF : 0x00;
+}
+
+static void
+setup_trial(BOOL unpack)
+{
+	emu_registers r = { 0, 0, 0, 0xF0, 0x20, 0 };
+
+	for (int i = 0x57; i < 0x61; i++)
+		memory[i] = rand();
+	random_float(&memory[0x61]);   /* FAC */
+	random_float(&memory[0x69]);   /* ARG */
+	memory[0x6F] = memory[0x66] ^ memory[0x6E];
+	memory[0x70] = rand();
+	memory[OPERAND] = rand() % 8 ? 0x78 + rand() % 16 : rand();
+	for (int i = 1; i < 5; i++)
+		memory[OPERAND + i] = rand();
+	if (unpack) {
+		/* the ARG entry points expect what CONUPK leaves behind */
+		r.a = OPERAND & 0xFF;
+		r.y = OPERAND >> 8;
+		rom(0xBA8C, &r);
+		r.s += 2;
+		r.pc = 0;
+	}
+	r.a = unpack ? r.a : OPERAND & 0xFF;
+	r.y = unpack ? r.y : OPERAND >> 8;
+	emu_set_registers(&r);
+	memcpy(before, memory, sizeof(before));
+}
+
+static void
+print_float(const char *name, const uint8_t *f)
+{
+	printf(" %s=%02X.%02X%02X%02X%02X.%02X", name, f[0], f[1], f[2], f[3], f[4], f[5]);
+}
+
+static void
+error(const char *name, const char *what)
+{
+	printf("%s: %s, before:", name, what);
+	print_float("FAC", &before[0x61]);
+	print_float("ARG", &before[0x69]);
+	printf(" op=%02X.%02X%02X%02X%02X\n", before[OPERAND], before[OPERAND + 1], before[OPERAND + 2], before[OPERAND + 3], before[OPERAND + 4]);
+	errors++;
+}
+
+static void
+test_routine(const char *name, unsigned short address, BOOL unpack, int trials)
+{
+	int handled = 0;
+
+	for (int t = 0; t < trials; t++) {
+		emu_registers r, r_rom;
+
+		setup_trial(unpack);
+		emu_get_registers(&r);
+
+		/* the ROM code */
+		r_rom = r;
+		BOOL ok = rom(address, &r_rom);
+		memcpy(after, memory, sizeof(after));
+
+		/* the HLE version, as the trap would call it */
+		memcpy(memory, before, sizeof(before));
+		memory[0x100 | r.s] = (STOP - 1) >> 8;
+		memory[0x100 | (uint8_t)(r.s - 1)] = (STOP - 1) & 0xFF;
+		A = r.a;
+		X = r.x;
+		Y = r.y;
+		S = r.s - 2;
+		P = r.p;
+		N = P >> 7;
+		Z = (P >> 1) & 1;
+		C = P & 1;
+		PC = address;
+		if (!handlers[address]()) {
+			memory[0x100 | r.s] = before[0x100 | r.s];
+			memory[0x100 | (uint8_t)(r.s - 1)] = before[0x100 | (uint8_t)(r.s - 1)];
+			if (memcmp(memory, before, sizeof(before)))
+				error(name, "gave up, but changed memory");
+			continue;
+		}
+		handled++;
+		if (!ok) {
+			error(name, "handled, but the ROM raises an error");
+			continue;
+		}
+		P = (P & 0x7C) | N << 7 | Z << 1 | C;
+		if (A != r_rom.a || X != r_rom.x || Y != r_rom.y || P != r_rom.p) {
+			printf("  ROM A=%02X X=%02X Y=%02X P=%02X, HLE A=%02X X=%02X Y=%02X P=%02X\n",
+				r_rom.a, r_rom.x, r_rom.y, r_rom.p, A, X, Y, P);
+			error(name, "registers differ");
+			continue;
+		}
+		/* the stack below the return address is scratch */
+		memset(memory + 0x100, 0, r.s + 1);
+		memset(after + 0x100, 0, r.s + 1);
+		for (int i = 0; i < 65536; i++) {
+			if (memory[i] != after[i]) {
+				printf("  $%04X: ROM %02X, HLE %02X\n", i, after[i], memory[i]);
+				error(name, "memory differs");
+				break;
+			}
+		}
+	}
+	printf("%-6s %d/%d handled\n", name, handled, trials);
+}
+
+int
+main()
+{
+	setup_basic();
+	hle_math_register_traps();
+
+	printf("testing arithmetic...\n");
+	test_routine("FADD", 0xB867, NO, ARITHMETIC_TRIALS);
+	test_routine("FADDT", 0xB86A, YES, ARITHMETIC_TRIALS);
+	test_routine("FMULT", 0xBA28, NO, ARITHMETIC_TRIALS);
+	test_routine("FMULTT", 0xBA2B, YES, ARITHMETIC_TRIALS);
+	test_routine("FDIV", 0xBB0F, NO, ARITHMETIC_TRIALS);
+	test_routine("FDIVT", 0xBB12, YES, ARITHMETIC_TRIALS);
+
+	printf("testing functions...\n");
+	test_routine("SQR", 0xBF71, NO, FUNCTION_TRIALS);
+	test_routine("LOG", 0xB9EA, NO, FUNCTION_TRIALS);
+	test_routine("EXP", 0xBFED, NO, FUNCTION_TRIALS);
+	test_routine("SIN", 0xE26B, NO, FUNCTION_TRIALS);
+
+	printf("%d errors\n", errors);
+	return errors != 0;
+}
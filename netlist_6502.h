@@ -66,8 +66,8 @@ enum {
 	clk0 = 1171,
 //	clk1out = 1163,
 //	clk2out = 421,
-//	clock1 = 156,
-//	clock2 = 1536,
+	clock1 = 156,
+	clock2 = 1536,
 //	cp1 = 710,
 	db0 = 1005,
 	db1 = 82,
@@ -114,14 +114,14 @@ enum {
 	notir5 = 1394,  // OK
 	notir6 = 895,   // OK
 	notir7 = 1320,
-//	nots0 = 418,
-//	nots1 = 1064,
-//	nots2 = 752,
-//	nots3 = 828,
-//	nots4 = 1603,
-//	nots5 = 601,
-//	nots6 = 1029,
-//	nots7 = 181,
+	nots0 = 418,
+	nots1 = 1064,
+	nots2 = 752,
+	nots3 = 828,
+	nots4 = 1603,
+	nots5 = 601,
+	nots6 = 1029,
+	nots7 = 181,
 	p0 = 687,
 	p1 = 1444,
 	p2 = 1421,
@@ -174,11 +174,11 @@ enum {
 //	sb6 = 1336,
 //	sb7 = 1001,
 	so = 1672,
-//	sync_ = 539,
-//	t2 = 971,
-//	t3 = 1567,
-//	t4 = 690,
-//	t5 = 909,
+	sync_ = 539,
+	t2 = 971,
+	t3 = 1567,
+	t4 = 690,
+	t5 = 909,
 	vcc = 657,
 	vss = 558,
 	x0 = 1216,
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "types.h"
 
 /* the smallest types to fit the numbers */
@@ -43,30 +44,93 @@ typedef uint16_t count_t;
  *
  ************************************************************/
 
-#if 1       /* faster on 64 bit CPUs */
+/* the width of the node bitmaps: make clean; make BITMAP_WIDTH=32 */
+#ifndef BITMAP_WIDTH
+#define BITMAP_WIDTH 64
+#endif
+
+#if BITMAP_WIDTH == 64       /* faster on 64 bit CPUs */
 typedef unsigned long long bitmap_t;
 #define BITMAP_SHIFT 6
 #define BITMAP_MASK 63
 #define ONE 1ULL
 
-#elif 0       /* faster on most 32 bit CPUs */
-typedef uint32_t bitmap_t;
+#elif BITMAP_WIDTH == 32       /* faster on most 32 bit CPUs */
+typedef unsigned int bitmap_t;
 #define BITMAP_SHIFT 5
 #define BITMAP_MASK 31
 #define ONE 1UL
 
-#else       /* faster in some cases (and compilers) that allow for vectorization */
+#elif BITMAP_WIDTH == 8       /* faster in some cases (and compilers) that allow for vectorization */
 typedef uint8_t bitmap_t;
 #define BITMAP_SHIFT 3
 #define BITMAP_MASK 7
 #define ONE 1U
 
+#else
+#error "BITMAP_WIDTH must be 8, 32 or 64"
 #endif
 
+/* groups that fit into the group cache, see cacheGroups() */
+#define GROUP_CACHE_MEMBERS 32
+#define GROUP_CACHE_GATES 256
+
+/* number of node lists that can be shadowed */
+#define MAX_SHADOWS 16
+
+/* 4-way set associative, see setMemo() */
+#define MEMO_WAYS 4
+
+/* a cached settle: the changes it makes to the values, the hash and the shadows */
+typedef struct {
+	unsigned long long key;
+	unsigned long long hash;
+	unsigned int shadows[MAX_SHADOWS];
+	BOOL valid;
+	BOOL referenced;
+	bitmap_t values[];
+} memo_entry_t;
+
+/* 4-way set associative, see setTraces() */
+#define TRACE_WAYS 4
+/* recording costs about as much as a settle, a hit saves one */
+#define TRACE_RECORD_COST 16
+#define TRACE_HIT_CREDIT 8
+#define TRACE_MAX_CREDIT 64
+
+/* one instruction of a trace: test or change the bits "mask" of a bitmap word */
+enum {
+	TRACE_VALUE,            /* guard: (value & mask) == bits */
+	TRACE_PULLUP,           /* guard: (pullup & mask) == bits */
+	TRACE_PULLDOWN,         /* guard: (pulldown & mask) == bits */
+	TRACE_XOR               /* value ^= mask */
+};
+
+typedef struct {
+	count_t word;
+	int op;
+	bitmap_t mask;
+	bitmap_t bits;
+} trace_op_t;
+
+/* a compiled settle: guards for what it read, then what it changed */
+typedef struct {
+	unsigned long long key;
+	unsigned long long hash;
+	unsigned int shadows[MAX_SHADOWS];
+	BOOL valid;
+	BOOL referenced;
+	count_t count;
+	count_t capacity;
+	trace_op_t *ops;
+} trace_t;
+
 /* list of nodes that need to be recalculated */
 typedef struct {
 	nodenum_t *list;
 	count_t count;
+	bitmap_t *bitmap;               /* the same nodes */
+	bitmap_t *summary;              /* words of "bitmap" that may be non-zero (bitmap scheduler) */
 } list_t;
 
 /* a transistor from the point of view of one of the connected nodes */
@@ -82,6 +146,55 @@ c1c2(nodenum_t gate, nodenum_t n)
 	return c;
 }
 
+/*
+ * a node list compiled for word-wise access: all nodes that live in
+ * the same bitmap word are extracted/deposited together
+ */
+#if defined(__BMI2__) && BITMAP_SHIFT == 6
+#include <immintrin.h>
+#define USE_PEXT 1
+#else
+#define USE_PEXT 0
+#endif
+
+typedef struct {
+	count_t word;           /* index into the node bitmaps */
+	bitmap_t src;           /* bits in the bitmap word */
+	unsigned int dst;       /* the same bits in the value */
+	int shift;              /* src >> shift == dst (without PEXT only) */
+} nodelist_group_t;
+
+typedef struct {
+	int count;
+	int groupcount;
+	nodenum_t nodes[32];
+	nodelist_group_t groups[32];
+} nodelist_t;
+
+/* a group as it was collected from "root", see cacheGroups() */
+typedef struct {
+	nodenum_t root;
+	uint8_t count;                  /* 0: empty */
+	uint8_t rail;                   /* contains_vss, contains_vcc or contains_nothing */
+	nodenum_t members[GROUP_CACHE_MEMBERS];
+	bitmap_t gates[GROUP_CACHE_GATES / (sizeof(bitmap_t) * 8)];
+} group_entry_t;
+
+/* where the group walk reads the bits of a node from, see setNodeLayout() */
+typedef enum {
+	layout_bitmaps,                 /* nodes_value, nodes_pullup, nodes_pulldown */
+	layout_interleaved,             /* nodes_triples */
+	layout_bytes,                   /* nodes_bytes */
+	layouts
+} layout_t;
+
+/* vector versions of the inner loops, see setKernels() */
+typedef struct {
+	const char *name;
+	unsigned int (*gates)(bitmap_t *values, const c1c2_t *c, count_t n);
+	unsigned int (*bits)(bitmap_t *bitmap, const nodenum_t *nodes, count_t n);
+} kernels_t;
+
 typedef struct {
 	nodenum_t nodes;
 	nodenum_t transistors;
@@ -92,6 +205,11 @@ typedef struct {
 	bitmap_t *nodes_pullup;
 	bitmap_t *nodes_pulldown;
 	bitmap_t *nodes_value;
+	unsigned long long *nodes_zobrist;  /* random key per node, see stateHash() */
+	layout_t nodes_layout;          /* copies of the three bitmaps above, see setNodeLayout() */
+	bitmap_t *nodes_triples;        /* value, pullup and pulldown word for every bitmap word */
+	uint8_t *nodes_bytes;           /* value | pullup << 1 | pulldown << 2 for every node */
+	bitmap_t *nodes_input;          /* ever driven through setNode() etc. */
 	c1c2_t *nodes_c1c2s;
 	count_t *nodes_c1c2offset;
 	nodenum_t *nodes_dependant;
@@ -106,12 +224,78 @@ typedef struct {
 	nodenum_t *list2;
 	list_t listout;
 
-	bitmap_t *listout_bitmap;
+	/* walk the bitmaps in node order instead of the lists, see setScheduler() */
+	BOOL bitmap_scheduler;
+	unsigned long iterations;
+
+	/* the inner loops, see setKernels() */
+	const kernels_t *kernels;
+
+	/*
+	 * nodes whose group has been recalculated in this iteration:
+	 * settled[node] == epoch, so a new iteration needs no clearing
+	 */
+	unsigned int *settled;
+	unsigned int epoch;
+	unsigned long floods_saved;
+
+	/* groups by the node they were collected from, see cacheGroups() */
+	group_entry_t *group_cache;
+	unsigned int group_cache_mask;
+	unsigned long group_hits;
+	unsigned long group_misses;
 
 	nodenum_t *group;
 	count_t groupcount;
 	bitmap_t *groupbitmap;
 
+	/* packed copies of node lists (registers, buses), see addShadow() */
+	uint8_t *nodes_shadow;          /* 0: not shadowed, else shadow index + 1 */
+	uint8_t *nodes_shadow_bit;
+	unsigned int shadows[MAX_SHADOWS];
+	int shadowcount;
+
+	/* inputs are only queued while > 0, see beginInput() */
+	int input_depth;
+
+	/* XOR of the keys of all nodes that are high */
+	unsigned long long hash;
+
+	/* settle results by the state they started in, see setMemo() */
+	uint8_t *memo;
+	size_t memo_entry_size;
+	unsigned int memo_sets;
+	uint8_t *memo_hand;
+	bitmap_t *memo_before;
+	unsigned long memo_hits;
+	unsigned long memo_misses;
+
+	/* per clock phase: a gate that ties each "off" dependant to GND, see setClock() */
+	nodenum_t clock;
+	nodenum_t *phase_clamps[2];
+	nodenum_t *clamps;              /* the current phase, or NULL */
+
+	/* the netlist specialized for nodes tied to constants, see tieNodes() */
+	nodelist_t *tied;
+	unsigned int tied_value;
+	c1c2_t *full_c1c2s;             /* the complete netlist while specialized */
+	count_t *full_c1c2offset;
+	bitmap_t *nodes_pruned;         /* gates of the removed transistors, see freezeNodes() */
+	bitmap_t *nodes_toggled;        /* while profiling, see profileNodes() */
+
+	/* compiled settles, see setTraces() */
+	trace_t *traces;
+	unsigned int trace_sets;
+	uint8_t *trace_hand;
+	unsigned long long *trace_seen;
+	int *trace_credit;
+	nodelist_t *trace_nodes;
+	BOOL trace_recording;
+	bitmap_t *trace_scratch;        /* while recording: values before, nodes read, members */
+	unsigned long trace_hits;
+	unsigned long trace_misses;
+
+	void *user_data;                /* whatever the chip keeps per instance, see setUserData() */
 } state_t;
 
 typedef enum {
@@ -162,6 +346,162 @@ get_bitmap(bitmap_t *bitmap, int index)
 	return (bitmap[index>>BITMAP_SHIFT] >> (index & BITMAP_MASK)) & 1;
 }
 
+/************************************************************
+ *
+ * Vector Kernels
+ *
+ ************************************************************/
+
+/*
+ * The inner loops test one bit for each of a run of nodes: the gates
+ * of a group member's transistors, the dependants of a flipped node and
+ * the members of a group. Runs of KERNEL_MIN nodes or more go through
+ * the kernels, which use gathers if the CPU has them. They read the
+ * bitmaps as 32 bit words, which on x86 is the same for 32 and 64 bit
+ * bitmap_t.
+ */
+#define KERNEL_MIN 8
+#define KERNEL_MAX 32
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && BITMAP_SHIFT >= 5
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+/* bit i set if the gate of c[i] is high, n <= KERNEL_MAX */
+static inline unsigned int
+gates_scalar(bitmap_t *values, const c1c2_t *c, count_t n)
+{
+	unsigned int on = 0;
+	for (count_t i = 0; i < n; i++)
+		on |= (unsigned int)get_bitmap(values, c[i].gate) << i;
+	return on;
+}
+
+/* bit i set if nodes[i] is set in the bitmap, n <= KERNEL_MAX */
+static inline unsigned int
+bits_scalar(bitmap_t *bitmap, const nodenum_t *nodes, count_t n)
+{
+	unsigned int set = 0;
+	for (count_t i = 0; i < n; i++)
+		set |= (unsigned int)get_bitmap(bitmap, nodes[i]) << i;
+	return set;
+}
+
+/* the same with one byte per node, see setNodeLayout() */
+static inline unsigned int
+gates_bytes(const uint8_t *bytes, const c1c2_t *c, count_t n)
+{
+	unsigned int on = 0;
+	for (count_t i = 0; i < n; i++)
+		on |= (unsigned int)(bytes[c[i].gate] & 1) << i;
+	return on;
+}
+
+static const kernels_t kernels_scalar = { "scalar", gates_scalar, bits_scalar };
+
+#if HAVE_X86_KERNELS
+/* a c1c2_t is read as a 32 bit word with the gate in the low half */
+__attribute__((target("avx2"))) static inline __m256i
+gather_bits_avx2(bitmap_t *bitmap, __m256i nodes, __m256i lanes)
+{
+	__m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)bitmap,
+		_mm256_srli_epi32(nodes, 5), lanes, 4);
+	return _mm256_srlv_epi32(words, _mm256_and_si256(nodes, _mm256_set1_epi32(31)));
+}
+
+__attribute__((target("avx2"))) static unsigned int
+gates_avx2(bitmap_t *values, const c1c2_t *c, count_t n)
+{
+	unsigned int on = 0;
+	for (count_t i = 0; i < n; i += 8) {
+		__m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		__m256i gates = _mm256_and_si256(_mm256_maskload_epi32((const int *)(c + i), lanes), _mm256_set1_epi32(0xFFFF));
+		__m256i bits = _mm256_slli_epi32(gather_bits_avx2(values, gates, lanes), 31);
+		on |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(bits)) << i;
+	}
+	return on;
+}
+
+__attribute__((target("avx2"))) static unsigned int
+bits_avx2(bitmap_t *bitmap, const nodenum_t *nodes, count_t n)
+{
+	unsigned int set = 0;
+	count_t i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i nn = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(nodes + i)));
+		__m256i bits = _mm256_slli_epi32(gather_bits_avx2(bitmap, nn, _mm256_set1_epi32(-1)), 31);
+		set |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(bits)) << i;
+	}
+	/* no 16 bit masked loads: the tail is scalar */
+	return set | bits_scalar(bitmap, nodes + i, n - i) << i;
+}
+
+static const kernels_t kernels_avx2 = { "avx2", gates_avx2, bits_avx2 };
+
+__attribute__((target("avx512f,avx512bw,avx512vl"))) static inline __mmask16
+gather_bits_avx512(bitmap_t *bitmap, __m512i nodes, __mmask16 lanes)
+{
+	__m512i words = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), lanes,
+		_mm512_srli_epi32(nodes, 5), bitmap, 4);
+	__m512i bits = _mm512_srlv_epi32(words, _mm512_and_si512(nodes, _mm512_set1_epi32(31)));
+	return _mm512_mask_test_epi32_mask(lanes, bits, _mm512_set1_epi32(1));
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl"))) static unsigned int
+gates_avx512(bitmap_t *values, const c1c2_t *c, count_t n)
+{
+	unsigned int on = 0;
+	for (count_t i = 0; i < n; i += 16) {
+		__mmask16 lanes = n - i >= 16 ? 0xFFFF : (1U << (n - i)) - 1;
+		__m512i gates = _mm512_and_si512(_mm512_maskz_loadu_epi32(lanes, c + i), _mm512_set1_epi32(0xFFFF));
+		on |= (unsigned int)gather_bits_avx512(values, gates, lanes) << i;
+	}
+	return on;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vl"))) static unsigned int
+bits_avx512(bitmap_t *bitmap, const nodenum_t *nodes, count_t n)
+{
+	unsigned int set = 0;
+	for (count_t i = 0; i < n; i += 16) {
+		__mmask16 lanes = n - i >= 16 ? 0xFFFF : (1U << (n - i)) - 1;
+		__m512i nn = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(lanes, nodes + i));
+		set |= (unsigned int)gather_bits_avx512(bitmap, nn, lanes) << i;
+	}
+	return set;
+}
+
+static const kernels_t kernels_avx512 = { "avx512", gates_avx512, bits_avx512 };
+#endif
+
+static inline unsigned int
+test_gates(state_t *state, const c1c2_t *c, count_t n)
+{
+	if (n < KERNEL_MIN) {
+		if (state->nodes_layout == layout_bytes)
+			return gates_bytes(state->nodes_bytes, c, n);
+		return gates_scalar(state->nodes_value, c, n);
+	}
+	return state->kernels->gates(state->nodes_value, c, n);
+}
+
+static inline unsigned int
+test_nodes(state_t *state, bitmap_t *bitmap, const nodenum_t *nodes, count_t n)
+{
+	if (n < KERNEL_MIN)
+		return bits_scalar(bitmap, nodes, n);
+	return state->kernels->bits(bitmap, nodes, n);
+}
+
+static inline unsigned int
+lanes_mask(count_t n)
+{
+	return n >= KERNEL_MAX ? ~0U : (1U << n) - 1;
+}
+
 /************************************************************
  *
  * Algorithms for Nodes
@@ -173,10 +513,31 @@ get_bitmap(bitmap_t *bitmap, int index)
  * so we don't bother initializing it properly or special-casing writes.
  */
 
+#define NODE_VALUE 0
+#define NODE_PULLUP 1
+#define NODE_PULLDOWN 2
+
+/* keep the copy of the node bits for the group walk, see setNodeLayout() */
+static inline void
+set_nodes_layout(state_t *state, transnum_t t, int bit, BOOL s)
+{
+	switch (state->nodes_layout) {
+	case layout_interleaved:
+		set_bitmap(&state->nodes_triples[3 * (t >> BITMAP_SHIFT) + bit], t & BITMAP_MASK, s);
+		break;
+	case layout_bytes:
+		state->nodes_bytes[t] = (state->nodes_bytes[t] & ~(1 << bit)) | s << bit;
+		break;
+	default:
+		break;
+	}
+}
+
 static inline void
 set_nodes_pullup(state_t *state, transnum_t t, BOOL s)
 {
 	set_bitmap(state->nodes_pullup, t, s);
+	set_nodes_layout(state, t, NODE_PULLUP, s);
 }
 
 static inline BOOL
@@ -189,6 +550,7 @@ static inline void
 set_nodes_pulldown(state_t *state, transnum_t t, BOOL s)
 {
 	set_bitmap(state->nodes_pulldown, t, s);
+	set_nodes_layout(state, t, NODE_PULLDOWN, s);
 }
 
 static inline BOOL
@@ -201,6 +563,7 @@ static inline void
 set_nodes_value(state_t *state, transnum_t t, BOOL s)
 {
 	set_bitmap(state->nodes_value, t, s);
+	set_nodes_layout(state, t, NODE_VALUE, s);
 }
 
 static inline BOOL
@@ -209,6 +572,61 @@ get_nodes_value(state_t *state, transnum_t t)
 	return get_bitmap(state->nodes_value, t);
 }
 
+/* value | pullup << 1 | pulldown << 2 */
+static inline unsigned int
+get_nodes_bits(state_t *state, transnum_t t)
+{
+	switch (state->nodes_layout) {
+	case layout_interleaved: {
+		const bitmap_t *w = &state->nodes_triples[3 * (t >> BITMAP_SHIFT)];
+		const int b = t & BITMAP_MASK;
+		return (w[NODE_VALUE] >> b & 1) | (w[NODE_PULLUP] >> b & 1) << 1 | (w[NODE_PULLDOWN] >> b & 1) << 2;
+	}
+	case layout_bytes:
+		return state->nodes_bytes[t];
+	default:
+		return get_nodes_value(state, t) | get_nodes_pullup(state, t) << 1 | get_nodes_pulldown(state, t) << 2;
+	}
+}
+
+/* copy words of the bitmaps that have been written as a whole into the layout */
+static void
+sync_nodes_layout(state_t *state, count_t first, count_t count)
+{
+	for (count_t w = first; w < first + count; w++) {
+		const bitmap_t v = state->nodes_value[w];
+		const bitmap_t u = state->nodes_pullup[w];
+		const bitmap_t d = state->nodes_pulldown[w];
+		if (state->nodes_layout == layout_interleaved) {
+			state->nodes_triples[3 * w + NODE_VALUE] = v;
+			state->nodes_triples[3 * w + NODE_PULLUP] = u;
+			state->nodes_triples[3 * w + NODE_PULLDOWN] = d;
+		} else if (state->nodes_layout == layout_bytes) {
+			for (int b = 0; b < BITMAP_MASK + 1; b++)
+				state->nodes_bytes[w * (BITMAP_MASK + 1) + b] = (v >> b & 1) | (u >> b & 1) << 1 | (d >> b & 1) << 2;
+		}
+	}
+}
+
+static inline void
+sync_nodes_word(state_t *state, count_t w)
+{
+	if (state->nodes_layout != layout_bitmaps)
+		sync_nodes_layout(state, w, 1);
+}
+
+/*
+ * A node has changed its value: keep the shadows up to date.
+ * This is a single byte test for all nodes that are not shadowed.
+ */
+static inline void
+update_nodes_shadow(state_t *state, nodenum_t nn)
+{
+	uint8_t shadow = state->nodes_shadow[nn];
+	if (shadow)
+		state->shadows[shadow - 1] ^= 1U << state->nodes_shadow_bit[nn];
+}
+
 /************************************************************
  *
  * Algorithms for Lists
@@ -235,20 +653,61 @@ lists_switch(state_t *state)
 	state->listout = tmp;
 }
 
+#define BITMAP_BITS (BITMAP_MASK + 1)
+#define SUMMARY_WORDS(a) WORDS_FOR_BITS(WORDS_FOR_BITS(a))
+
 static inline void
 listout_clear(state_t *state)
 {
-	state->listout.count = 0;
-	bitmap_clear(state->listout_bitmap, state->nodes);
+	list_t *out = &state->listout;
+
+	out->count = 0;
+	if (!state->bitmap_scheduler) {
+		bitmap_clear(out->bitmap, state->nodes);
+		return;
+	}
+	/* only the words that have been touched */
+	for (count_t s = 0; s < SUMMARY_WORDS(state->nodes); s++) {
+		for (bitmap_t words = out->summary[s]; words; words &= words - 1)
+			out->bitmap[s * BITMAP_BITS + __builtin_ctzll(words)] = 0;
+		out->summary[s] = 0;
+	}
 }
 
 static inline void
 listout_add(state_t *state, nodenum_t i)
 {
-	if (get_bitmap(state->listout_bitmap, i) == 0) {
-		set_bitmap(state->listout_bitmap, i, 1);
-		state->listout.list[state->listout.count++] = i;
+	list_t *out = &state->listout;
+
+	if (get_bitmap(out->bitmap, i) == 0) {
+		set_bitmap(out->bitmap, i, 1);
+		if (state->bitmap_scheduler)
+			set_bitmap(out->summary, i >> BITMAP_SHIFT, 1);
+		else
+			out->list[out->count] = i;
+		out->count++;
+	}
+}
+
+/* mix the queued nodes into a key */
+static inline unsigned long long
+listout_key(state_t *state, unsigned long long key)
+{
+	const list_t *out = &state->listout;
+
+	if (!state->bitmap_scheduler) {
+		for (count_t i = 0; i < out->count; i++)
+			key = (key ^ out->list[i]) * 0xBF58476D1CE4E5B9ULL;
+		return key ^ (key >> 31);
 	}
+	for (count_t s = 0; s < SUMMARY_WORDS(state->nodes); s++) {
+		for (bitmap_t words = out->summary[s]; words; words &= words - 1) {
+			count_t w = s * BITMAP_BITS + __builtin_ctzll(words);
+			for (bitmap_t bits = out->bitmap[w]; bits; bits &= bits - 1)
+				key = (key ^ (w * BITMAP_BITS + __builtin_ctzll(bits))) * 0xBF58476D1CE4E5B9ULL;
+		}
+	}
+	return key ^ (key >> 31);
 }
 
 /************************************************************
@@ -307,64 +766,181 @@ group_count(state_t *state)
  *
  ************************************************************/
 
+/* the strongest driver a node contributes to its group, see get_nodes_bits() */
+static const uint8_t node_drive[8] = {
+	contains_nothing, contains_hi, contains_pullup, contains_pullup,
+	contains_pulldown, contains_pulldown, contains_pulldown, contains_pulldown
+};
+
 static inline group_value
-addNodeToGroup(state_t *state, nodenum_t n, group_value val)
+max_value(group_value a, group_value b)
 {
-	/*
-	 * We need to stop at vss and vcc, otherwise we'll revisit other groups
-	 * with the same value - just because they all derive their value from
-	 * the fact that they are connected to vcc or vss.
-	 */
-	if (n == state->vss) {
+	return a > b ? a : b;
+}
+
+/*
+ * The group is built breadth-first: the group array doubles as the
+ * queue of nodes whose transistors still have to be visited, so there
+ * is no recursion, and the c1c2 range of a node can be prefetched as
+ * soon as it is queued.
+ *
+ * We need to stop at vss and vcc, otherwise we'll revisit other groups
+ * with the same value - just because they all derive their value from
+ * the fact that they are connected to vcc or vss. A group's value is
+ * the strongest of its drivers, so it doesn't depend on the order in
+ * which they are found.
+ */
+static inline group_value
+addAllNodesToGroup(state_t *state, nodenum_t node)
+{
+	const nodenum_t vss = state->vss;
+	const nodenum_t vcc = state->vcc;
+	const count_t *offset = state->nodes_c1c2offset;
+	const c1c2_t *node_c1c2s = state->nodes_c1c2s;
+	group_value val = contains_nothing;
+
+	group_clear(state);
+	if (node == vss)
 		return contains_vss;
-	}
-    
-	if (n == state->vcc) {
-		if (val != contains_vss)
-			val = contains_vcc;
-		return val;
+	if (node == vcc)
+		return contains_vcc;
+	group_add(state, node);
+
+	for (count_t i = 0; i < group_count(state); i++) {
+		nodenum_t n = group_get(state, i);
+		val = max_value(val, node_drive[get_nodes_bits(state, n)]);
+
+		/* revisit all transistors that control this node */
+		const count_t end = offset[n+1];
+		for (count_t t = offset[n]; t < end; t += KERNEL_MAX) {
+			const count_t len = end - t < KERNEL_MAX ? end - t : KERNEL_MAX;
+			/* the transistors that connect c1 and c2 */
+			for (unsigned int on = test_gates(state, &node_c1c2s[t], len); on; on &= on - 1) {
+				nodenum_t other = node_c1c2s[t + __builtin_ctz(on)].other_node;
+				if (other == vss)
+					val = contains_vss;
+				else if (other == vcc)
+					val = max_value(val, contains_vcc);
+				else if (!group_contains(state, other)) {
+					group_add(state, other);
+					__builtin_prefetch(&node_c1c2s[offset[other]]);
+				}
+			}
+		}
 	}
 
-    /* check and see if we already have this node, and if so return */
-	if (group_contains(state, n))
-		return val;
+	return val;
+}
+
+/************************************************************
+ *
+ * Group Cache
+ *
+ ************************************************************/
 
-	group_add(state, n);
+/*
+ * Which nodes end up in a group only depends on the gates of the
+ * transistors of its members: if they all still have the values they
+ * had when the group was collected from the same node, the group is the
+ * same, and only its value has to be found again from the pullups,
+ * pulldowns and values of the members. cacheGroups() keeps small
+ * groups by the node they were collected from, with one bit per
+ * transistor of their members.
+ */
+static BOOL
+group_entry_matches(state_t *state, const group_entry_t *e)
+{
+	count_t bit = 0;
 
-    /* Give the compiler a hint that all of these can be calculated, and don't need to wait on branches.
-       This results in a small speedup.
-    */
-    BOOL isPulldown = get_nodes_pulldown(state, n);
-    BOOL isPullup = get_nodes_pullup(state, n);
-    BOOL nodeValue = get_nodes_value(state, n);
-	if (val < contains_pulldown && isPulldown)
-		val = contains_pulldown;
-	if (val < contains_pullup && isPullup)
-		val = contains_pullup;
-	if (val < contains_hi && nodeValue)
-		val = contains_hi;
-    /* state can remain at contains_nothing if the node value is low */
-
-	/* revisit all transistors that control this node */
-    const count_t start = state->nodes_c1c2offset[n];
-	const count_t end = state->nodes_c1c2offset[n+1];
-    const c1c2_t *node_c1c2s = state->nodes_c1c2s;
-	for (count_t t = start; t < end; t++) {
-		const c1c2_t c = node_c1c2s[t];
-		/* if the transistor connects c1 and c2... */
-		if (get_nodes_value(state, c.gate)) {
-			val = addNodeToGroup(state, c.other_node, val);
+	for (int i = 0; i < e->count; i++) {
+		nodenum_t nn = e->members[i];
+		for (count_t t = state->nodes_c1c2offset[nn]; t < state->nodes_c1c2offset[nn+1]; t++, bit++) {
+			if (get_nodes_value(state, state->nodes_c1c2s[t].gate) != get_bitmap((bitmap_t *)e->gates, bit))
+				return NO;
 		}
 	}
- 
-    return val;
+	return YES;
 }
 
-static inline group_value
-addAllNodesToGroup(state_t *state, nodenum_t node)
+static void
+group_entry_store(state_t *state, group_entry_t *e, nodenum_t root, group_value val)
 {
-	group_clear(state);
-	return addNodeToGroup(state, node, contains_nothing);
+	count_t bit = 0;
+
+	e->count = 0;
+	if (group_count(state) > GROUP_CACHE_MEMBERS)
+		return;
+	for (count_t i = 0; i < group_count(state); i++) {
+		nodenum_t nn = group_get(state, i);
+		if (bit + state->nodes_c1c2offset[nn+1] - state->nodes_c1c2offset[nn] > GROUP_CACHE_GATES)
+			return;
+		e->members[i] = nn;
+		for (count_t t = state->nodes_c1c2offset[nn]; t < state->nodes_c1c2offset[nn+1]; t++, bit++)
+			set_bitmap(e->gates, bit, get_nodes_value(state, state->nodes_c1c2s[t].gate));
+	}
+	e->root = root;
+	e->rail = val == contains_vss || val == contains_vcc ? val : contains_nothing;
+	e->count = group_count(state);
+}
+
+static group_value
+addCachedNodesToGroup(state_t *state, nodenum_t node)
+{
+	group_entry_t *e = &state->group_cache[node & state->group_cache_mask];
+
+	if (e->count && e->root == node && group_entry_matches(state, e)) {
+		group_value val = e->rail;
+		group_clear(state);
+		for (int i = 0; i < e->count; i++) {
+			nodenum_t nn = e->members[i];
+			group_add(state, nn);
+			val = max_value(val, node_drive[get_nodes_bits(state, nn)]);
+		}
+		state->group_hits++;
+		return val;
+	}
+
+	group_value val = addAllNodesToGroup(state, node);
+	group_entry_store(state, e, node, val);
+	state->group_misses++;
+	return val;
+}
+
+static void
+flush_group_cache(state_t *state)
+{
+	if (state->group_cache)
+		memset(state->group_cache, 0, (state->group_cache_mask + 1) * sizeof(group_entry_t));
+}
+
+/*
+ * Keep up to "entries" groups (rounded down to a power of two), 0 turns
+ * the cache off.
+ */
+void
+cacheGroups(state_t *state, unsigned int entries)
+{
+	free(state->group_cache);
+	state->group_cache = NULL;
+	state->group_hits = 0;
+	state->group_misses = 0;
+	if (!entries)
+		return;
+
+	unsigned int size = 1;
+	while (size * 2 <= entries)
+		size *= 2;
+	state->group_cache = calloc(size, sizeof(group_entry_t));
+	state->group_cache_mask = size - 1;
+}
+
+/* floods saved by skipping settled nodes, and group cache hits and misses */
+void
+getGroupStats(state_t *state, unsigned long *saved, unsigned long *hits, unsigned long *misses)
+{
+	*saved = state->floods_saved;
+	*hits = state->group_hits;
+	*misses = state->group_misses;
 }
 
 static inline BOOL
@@ -384,6 +960,74 @@ getGroupValue(group_value node_value)
 	return NO;
 }
 
+static void untie_nodes(state_t *state);
+static void check_pruned(state_t *state);
+
+/* values changed by XORing in a recorded delta instead of flip_node() */
+static inline void
+replayed(state_t *state, const bitmap_t *changes)
+{
+	if (state->nodes_toggled) {
+		for (count_t i = 0; i < WORDS_FOR_BITS(state->nodes); i++)
+			state->nodes_toggled[i] |= changes[i];
+	}
+	if (state->nodes_layout != layout_bitmaps) {
+		for (count_t i = 0; i < WORDS_FOR_BITS(state->nodes); i++)
+			if (changes[i])
+				sync_nodes_layout(state, i, 1);
+	}
+	check_pruned(state);
+}
+
+/* queue dependent_block[start..end), long runs without the ones already queued */
+static inline void
+listout_add_dependants(state_t *state, count_t start, count_t end, const nodenum_t *clamps)
+{
+	const nodenum_t *deps = state->dependent_block;
+
+	if (end - start < KERNEL_MIN) {
+		for (count_t g = start; g < end; g++) {
+			if (!clamps || !get_nodes_value(state, clamps[g]))
+				listout_add(state, deps[g]);
+		}
+		return;
+	}
+	for (count_t g = start; g < end; g += KERNEL_MAX) {
+		const count_t len = end - g < KERNEL_MAX ? end - g : KERNEL_MAX;
+		unsigned int add = ~test_nodes(state, state->listout.bitmap, &deps[g], len) & lanes_mask(len);
+		if (clamps)
+			add &= ~test_nodes(state, state->nodes_value, &clamps[g], len);
+		for (; add; add &= add - 1)
+			listout_add(state, deps[g + __builtin_ctz(add)]);
+	}
+}
+
+static inline void
+flip_node(state_t *state, nodenum_t nn, BOOL newv)
+{
+	set_nodes_value(state, nn, newv);
+	update_nodes_shadow(state, nn);
+	state->hash ^= state->nodes_zobrist[nn];
+	if (state->nodes_toggled)
+		set_bitmap(state->nodes_toggled, nn, 1);
+
+	if (newv) {
+		/* a frozen node thawed, see freezeNodes() */
+		if (state->nodes_pruned && get_bitmap(state->nodes_pruned, nn))
+			untie_nodes(state);
+        const nodenum_t dep_offset = state->nodes_left_dependant[nn];
+        const nodenum_t dep_end = state->nodes_left_dependant[nn+1];
+		listout_add_dependants(state, dep_offset, dep_end, NULL);
+	} else {
+        const nodenum_t dep_offset = state->nodes_dependant[nn];
+        const nodenum_t dep_end = state->nodes_dependant[nn+1];
+		/* skip nodes that are tied to GND anyway, see setClock() */
+		listout_add_dependants(state, dep_offset, dep_end, state->clamps);
+	}
+}
+
+static void trace_mark(state_t *state);
+
 static inline void
 recalcNode(state_t *state, nodenum_t node)
 {
@@ -391,11 +1035,16 @@ recalcNode(state_t *state, nodenum_t node)
 	 * get all nodes that are connected through
 	 * transistors, starting with this one
 	 */
-	group_value node_value = addAllNodesToGroup(state, node);
+	group_value node_value = state->group_cache ?
+		addCachedNodesToGroup(state, node) :
+		addAllNodesToGroup(state, node);
 
 	/* get the state of the group */
 	BOOL newv = getGroupValue(node_value);
 
+	if (state->trace_recording)
+		trace_mark(state);
+
 	/*
 	 * - set all nodes to the group state
 	 * - check all transistors switched by nodes of the group
@@ -403,30 +1052,59 @@ recalcNode(state_t *state, nodenum_t node)
 	 *   for the next run
 	 */
     const count_t grp_count = group_count(state);
-	for (count_t i = 0; i < grp_count; i++) {
-		const nodenum_t nn = group_get(state, i);
-		if (get_nodes_value(state, nn) != newv) {
-			set_nodes_value(state, nn, newv);
-
-			if (newv) {
-                const nodenum_t dep_offset = state->nodes_left_dependant[nn];
-                const nodenum_t dep_end = state->nodes_left_dependant[nn+1];
-				for (count_t g = dep_offset; g < dep_end; g++) {
-					listout_add(state, state->dependent_block[g]);
-				}
-			} else {
-                const nodenum_t dep_offset = state->nodes_dependant[nn];
-                const nodenum_t dep_end = state->nodes_dependant[nn+1];
-				for (count_t g = dep_offset; g < dep_end; g++) {
-					listout_add(state, state->dependent_block[g]);
-				}
-			}
+	for (count_t i = 0; i < grp_count; i += KERNEL_MAX) {
+		const count_t len = grp_count - i < KERNEL_MAX ? grp_count - i : KERNEL_MAX;
+		const nodenum_t *members = &state->group[i];
+		unsigned int flip = test_nodes(state, state->nodes_value, members, len) ^ (newv ? lanes_mask(len) : 0);
+		for (count_t j = 0; j < len; j++)
+			state->settled[members[j]] = state->epoch;
+		for (; flip; flip &= flip - 1)
+			flip_node(state, members[__builtin_ctz(flip)], newv);
+	}
+}
+
+/*
+ * A node that was part of a group recalculated earlier in the same
+ * iteration already has the value a second flood would give it: if a
+ * transistor in between has changed the group, its nodes have been
+ * queued for the next iteration.
+ */
+static inline void
+recalcQueuedNode(state_t *state, nodenum_t node)
+{
+	if (state->settled[node] == state->epoch) {
+		state->floods_saved++;
+		return;
+	}
+	recalcNode(state, node);
+}
+
+
+/*
+ * The bitmap scheduler: recalculate the queued nodes in node order,
+ * clearing the words of the bitmap as they are taken.
+ */
+static inline void
+recalc_bitmap(state_t *state)
+{
+	list_t *in = &state->listin;
+
+	for (count_t s = 0; s < SUMMARY_WORDS(state->nodes); s++) {
+		bitmap_t words = in->summary[s];
+		in->summary[s] = 0;
+		for (; words; words &= words - 1) {
+			count_t w = s * BITMAP_BITS + __builtin_ctzll(words);
+			bitmap_t bits = in->bitmap[w];
+			in->bitmap[w] = 0;
+			for (; bits; bits &= bits - 1)
+				recalcQueuedNode(state, w * BITMAP_BITS + __builtin_ctzll(bits));
 		}
 	}
+	in->count = 0;
 }
 
-void
-recalcNodeList(state_t *state)
+static BOOL
+settle_network(state_t *state)
 {
     const int max_iterations = 50;
     int j;
@@ -451,10 +1129,19 @@ recalcNodeList(state_t *state)
 		 * all transistors controlled by this path, collecting
 		 * all nodes that changed because of it for the next run
 		 */
+        state->iterations++;
+		if (!++state->epoch) {
+			memset(state->settled, 0, state->nodes * sizeof(*state->settled));
+			state->epoch = 1;
+		}
+		if (state->bitmap_scheduler) {
+			recalc_bitmap(state);
+			continue;
+		}
         const count_t list_count = listin_count(state);
 		for (count_t i = 0; i < list_count; i++) {
 			nodenum_t n = listin_get(state, i);
-			recalcNode(state, n);
+			recalcQueuedNode(state, n);
 		}
 	}
     
@@ -464,55 +1151,787 @@ recalcNodeList(state_t *state)
     
     /* without this, we'll have a bogus listin on the next step */
 	listout_clear(state);
+	return j < max_iterations;
 }
 
 /************************************************************
  *
- * Initialization
+ * Traces
  *
  ************************************************************/
 
-static inline void
-add_nodes_dependant(state_t *state, nodenum_t a, nodenum_t b, nodenum_t *counts, nodenum_t offset )
+/*
+ * Most settles repeat one of a few thousand patterns: the same clock
+ * edge in the same T-state of the same opcode floods the same groups.
+ * A trace is such a settle compiled into straight-line code: guards
+ * for the nodes it read (group members and the gates of their
+ * transistors) with their values before it started and for the
+ * pullups/pulldowns of the members, then XORs for the values it changed.
+ * Only the bitmap words it touched get an instruction. If every guard
+ * holds, the network would take exactly the same path again, so the
+ * changes are applied right away, no matter what the rest of the chip
+ * does; the first guard that fails sends the settle back to
+ * settle_network().
+ *
+ * Traces are found by the queued nodes and a few state nodes chosen by
+ * the caller (see setTraces()), and a key can have several traces for
+ * different data.
+ */
+static inline trace_t *
+trace_entry(state_t *state, unsigned int set, int way)
 {
-    /* O(N^2) behavior, but only run during initialization
-    NOTE - counts are still being set and cannot be calculated from offsets
-    */
-    nodenum_t *dependent_data = state->dependent_block + offset;
-    const nodenum_t dep_count = counts[a];
-	for (count_t g = 0; g < dep_count; g++)
-        if (dependent_data[g] == b)
-            return;
-
-	dependent_data[ counts[a]++ ] = b;
+	return &state->traces[set * TRACE_WAYS + way];
 }
 
+/* recalcNode() while recording: remember the members of the group */
+static void
+trace_mark(state_t *state)
+{
+	bitmap_t *members = state->trace_scratch + 2 * WORDS_FOR_BITS(state->nodes);
 
-/*  6502:
-        3288 transistors, 3239 used in simulation after duplicate removal
-        1725 entries in node list and used in simulation
-        c1c2total = 6478
-        block_dep_size = 7260
+	for (count_t i = 0; i < group_count(state); i++)
+		set_bitmap(members, group_get(state, i), 1);
+}
 
-    Working set = 89 KB allocations, 220 KB binary, plus system libs and text buffering
-                = 604 KB in release build
-*/
-state_t *
-setupNodesAndTransistors(netlist_transdefs *transdefs, BOOL *node_is_pullup, nodenum_t nodes, nodenum_t transistors, nodenum_t vss, nodenum_t vcc)
+/*
+ * after recording: the members and the gates of all their transistors
+ * have been read, and so have the clamps of the dependants of the ones
+ * that went low (every node that changed was a member)
+ */
+static void
+trace_mark_read(state_t *state, bitmap_t *read, const bitmap_t *members)
 {
-	/* allocate state */
-	state_t *state = malloc(sizeof(state_t));
-	state->nodes = nodes;
-	state->transistors = transistors;
-	state->vss = vss;
-	state->vcc = vcc;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+
+	if (state->clamps)
+		set_bitmap(read, state->clock, 1);
+	for (count_t w = 0; w < words; w++) {
+		read[w] |= members[w];
+		for (bitmap_t bits = members[w]; bits; bits &= bits - 1) {
+			nodenum_t nn = w * sizeof(bitmap_t) * 8 + __builtin_ctzll(bits);
+			for (count_t t = state->nodes_c1c2offset[nn]; t < state->nodes_c1c2offset[nn+1]; t++)
+				set_bitmap(read, state->nodes_c1c2s[t].gate, 1);
+			if (state->clamps) {
+				for (count_t g = state->nodes_dependant[nn]; g < state->nodes_dependant[nn+1]; g++)
+					set_bitmap(read, state->clamps[g], 1);
+			}
+		}
+	}
+}
+
+/* run a trace: NO (and nothing changed) as soon as a guard fails */
+static BOOL
+trace_run(state_t *state, trace_t *t)
+{
+	const trace_op_t *op = t->ops;
+	const trace_op_t *last = t->ops + t->count;
+
+	for (; op < last && op->op != TRACE_XOR; op++) {
+		const bitmap_t *bitmap = op->op == TRACE_VALUE ? state->nodes_value :
+		    op->op == TRACE_PULLUP ? state->nodes_pullup : state->nodes_pulldown;
+		if ((bitmap[op->word] & op->mask) != op->bits)
+			return NO;
+	}
+	for (; op < last; op++) {
+		state->nodes_value[op->word] ^= op->mask;
+		if (state->nodes_toggled)
+			state->nodes_toggled[op->word] |= op->mask;
+		if (state->nodes_layout != layout_bitmaps)
+			sync_nodes_layout(state, op->word, 1);
+	}
+	state->hash ^= t->hash;
+	for (int i = 0; i < state->shadowcount; i++)
+		state->shadows[i] ^= t->shadows[i];
+	listout_clear(state);
+	check_pruned(state);
+	return YES;
+}
+
+static void
+trace_emit(trace_t *t, count_t word, int op, bitmap_t mask, bitmap_t bits)
+{
+	if (!mask)
+		return;
+	if (t->count == t->capacity) {
+		t->capacity = t->capacity ? 2 * t->capacity : 64;
+		t->ops = realloc(t->ops, t->capacity * sizeof(trace_op_t));
+	}
+	t->ops[t->count++] = (trace_op_t){ word, op, mask, bits };
+}
+
+static unsigned long long
+trace_key(state_t *state)
+{
+	return listout_key(state, readNodeList(state, state->trace_nodes));
+}
+
+/* a clock per set, like the memo cache */
+static trace_t *
+trace_victim(state_t *state, unsigned int set)
+{
+	for (;;) {
+		trace_t *t = trace_entry(state, set, state->trace_hand[set]);
+		state->trace_hand[set] = (state->trace_hand[set] + 1) % TRACE_WAYS;
+		if (!t->valid || !t->referenced)
+			return t;
+		t->referenced = NO;
+	}
+}
+
+static void
+run_network(state_t *state)
+{
+	if (!state->traces) {
+		settle_network(state);
+		return;
+	}
+
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	unsigned long long key = trace_key(state);
+	unsigned int set = key & (state->trace_sets - 1);
+
+	for (int way = 0; way < TRACE_WAYS; way++) {
+		trace_t *t = trace_entry(state, set, way);
+		if (t->valid && t->key == key && trace_run(state, t)) {
+			t->referenced = YES;
+			if (state->trace_credit[set] < TRACE_MAX_CREDIT)
+				state->trace_credit[set] += TRACE_HIT_CREDIT;
+			state->trace_hits++;
+			return;
+		}
+	}
+
+	/*
+	 * a key is only worth recording once it comes back, and only in a
+	 * set whose traces get hit: where the data is different every
+	 * time, recording would just make every settle twice as expensive
+	 */
+	if (state->trace_seen[set] != key || state->trace_credit[set] < 0) {
+		state->trace_seen[set] = key;
+		if (state->trace_credit[set] < 0)
+			state->trace_credit[set]++;
+		state->trace_misses++;
+		settle_network(state);
+		return;
+	}
+	state->trace_credit[set] -= TRACE_RECORD_COST;
+
+	bitmap_t *before = state->trace_scratch;
+	bitmap_t *read = before + words;
+	bitmap_t *members = read + words;
+	unsigned long long hash = state->hash;
+	unsigned int shadows[MAX_SHADOWS];
+	memcpy(before, state->nodes_value, words * sizeof(bitmap_t));
+	memcpy(shadows, state->shadows, sizeof(shadows));
+	memset(read, 0, 2 * words * sizeof(bitmap_t));
+
+	state->trace_recording = YES;
+	BOOL ok = settle_network(state);
+	state->trace_recording = NO;
+	state->trace_misses++;
+	if (!ok)
+		return;
+
+	trace_mark_read(state, read, members);
+	trace_t *t = trace_victim(state, set);
+	t->count = 0;
+	for (count_t i = 0; i < words; i++) {
+		trace_emit(t, i, TRACE_VALUE, read[i], before[i] & read[i]);
+		trace_emit(t, i, TRACE_PULLUP, members[i], state->nodes_pullup[i] & members[i]);
+		trace_emit(t, i, TRACE_PULLDOWN, members[i], state->nodes_pulldown[i] & members[i]);
+	}
+	for (count_t i = 0; i < words; i++)
+		trace_emit(t, i, TRACE_XOR, before[i] ^ state->nodes_value[i], 0);
+	t->key = key;
+	t->hash = hash ^ state->hash;
+	for (int i = 0; i < MAX_SHADOWS; i++)
+		t->shadows[i] = shadows[i] ^ state->shadows[i];
+	t->valid = YES;
+	t->referenced = NO;
+}
+
+static void
+free_traces(state_t *state)
+{
+	if (state->traces) {
+		for (unsigned int i = 0; i < state->trace_sets * TRACE_WAYS; i++)
+			free(state->traces[i].ops);
+	}
+	free(state->traces);
+	free(state->trace_hand);
+	free(state->trace_seen);
+	free(state->trace_credit);
+	free(state->trace_scratch);
+	if (state->trace_nodes)
+		destroyNodeList(state->trace_nodes);
+	state->traces = NULL;
+	state->trace_hand = NULL;
+	state->trace_seen = NULL;
+	state->trace_credit = NULL;
+	state->trace_scratch = NULL;
+	state->trace_nodes = NULL;
+}
+
+/*
+ * Keep up to "entries" traces (rounded down to a power of two), 0 turns
+ * them off. The key nodes (at most 32) should tell apart what the chip
+ * is doing, like the opcode and the T-state.
+ */
+void
+setTraces(state_t *state, unsigned int entries, int count, nodenum_t *nodelist)
+{
+	free_traces(state);
+	state->trace_hits = 0;
+	state->trace_misses = 0;
+	if (entries < TRACE_WAYS)
+		return;
+
+	unsigned int sets = 1;
+	while (sets * 2 * TRACE_WAYS <= entries)
+		sets *= 2;
+	state->trace_sets = sets;
+	state->traces = calloc(sets * TRACE_WAYS, sizeof(trace_t));
+	state->trace_hand = calloc(sets, sizeof(*state->trace_hand));
+	state->trace_seen = calloc(sets, sizeof(*state->trace_seen));
+	state->trace_credit = calloc(sets, sizeof(*state->trace_credit));
+	state->trace_scratch = calloc(3 * WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t));
+	state->trace_nodes = compileNodeList(state, count, nodelist);
+}
+
+void
+getTraceStats(state_t *state, unsigned long *hits, unsigned long *misses)
+{
+	*hits = state->trace_hits;
+	*misses = state->trace_misses;
+}
+
+/************************************************************
+ *
+ * Memoization
+ *
+ ************************************************************/
+
+/*
+ * How the network settles only depends on the node values, the inputs
+ * (pullup/pulldown bitmaps) and the nodes queued for recalculation.
+ * The memo cache keys settles by a hash of these and stores what they
+ * changed, so repeating one is a few XORs instead of walking groups.
+ * The value hash is maintained incrementally, the inputs and the queue
+ * are small enough to hash every time.
+ */
+
+/* the value hash combined with the inputs: equal keys, equal behavior */
+unsigned long long
+stateKey(state_t *state)
+{
+	unsigned long long key = state->hash;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	for (count_t i = 0; i < words; i++) {
+		key = (key ^ state->nodes_pullup[i]) * 0x9E3779B97F4A7C15ULL;
+		key = (key ^ state->nodes_pulldown[i]) * 0x9E3779B97F4A7C15ULL;
+	}
+	return key ^ (key >> 31);
+}
+
+static unsigned long long
+memo_key(state_t *state)
+{
+	return listout_key(state, stateKey(state));
+}
+
+static inline memo_entry_t *
+memo_entry(state_t *state, unsigned int set, int way)
+{
+	return (memo_entry_t *)(state->memo + (set * MEMO_WAYS + way) * state->memo_entry_size);
+}
+
+/* a clock per set: take the first entry that has not been used since the hand last passed */
+static memo_entry_t *
+memo_victim(state_t *state, unsigned int set)
+{
+	for (;;) {
+		memo_entry_t *e = memo_entry(state, set, state->memo_hand[set]);
+		state->memo_hand[set] = (state->memo_hand[set] + 1) % MEMO_WAYS;
+		if (!e->valid || !e->referenced)
+			return e;
+		e->referenced = NO;
+	}
+}
+
+static void check_tied(state_t *state);
+
+void
+recalcNodeList(state_t *state)
+{
+	if (state->tied)
+		check_tied(state);
+
+	if (!state->memo) {
+		run_network(state);
+		return;
+	}
+
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	unsigned long long key = memo_key(state);
+	unsigned int set = key & (state->memo_sets - 1);
+
+	for (int way = 0; way < MEMO_WAYS; way++) {
+		memo_entry_t *e = memo_entry(state, set, way);
+		if (e->valid && e->key == key) {
+			for (count_t i = 0; i < words; i++)
+				state->nodes_value[i] ^= e->values[i];
+			state->hash ^= e->hash;
+			for (int i = 0; i < state->shadowcount; i++)
+				state->shadows[i] ^= e->shadows[i];
+			e->referenced = YES;
+			state->memo_hits++;
+			listout_clear(state);
+			replayed(state, e->values);
+			return;
+		}
+	}
+
+	unsigned long long hash = state->hash;
+	unsigned int shadows[MAX_SHADOWS];
+	memcpy(state->memo_before, state->nodes_value, words * sizeof(bitmap_t));
+	memcpy(shadows, state->shadows, sizeof(shadows));
+
+	run_network(state);
+
+	memo_entry_t *e = memo_victim(state, set);
+	e->key = key;
+	e->hash = hash ^ state->hash;
+	for (int i = 0; i < MAX_SHADOWS; i++)
+		e->shadows[i] = shadows[i] ^ state->shadows[i];
+	for (count_t i = 0; i < words; i++)
+		e->values[i] = state->memo_before[i] ^ state->nodes_value[i];
+	e->valid = YES;
+	e->referenced = NO;
+	state->memo_misses++;
+}
+
+/*
+ * Cache up to "entries" settles (rounded down to a power of two), 0
+ * turns the cache off. Hits rely on the 64 bit key alone: two different
+ * states with the same key would be confused, which is as unlikely as
+ * any other 64 bit hash collision.
+ */
+void
+setMemo(state_t *state, unsigned int entries)
+{
+	free(state->memo);
+	free(state->memo_hand);
+	free(state->memo_before);
+	state->memo = NULL;
+	state->memo_hand = NULL;
+	state->memo_before = NULL;
+	state->memo_hits = 0;
+	state->memo_misses = 0;
+	if (entries < MEMO_WAYS)
+		return;
+
+	unsigned int sets = 1;
+	while (sets * 2 * MEMO_WAYS <= entries)
+		sets *= 2;
+	state->memo_sets = sets;
+	state->memo_entry_size = sizeof(memo_entry_t) + WORDS_FOR_BITS(state->nodes) * sizeof(bitmap_t);
+	state->memo = calloc(sets * MEMO_WAYS, state->memo_entry_size);
+	state->memo_hand = calloc(sets, sizeof(*state->memo_hand));
+	state->memo_before = calloc(WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t));
+}
+
+void
+getMemoStats(state_t *state, unsigned long *hits, unsigned long *misses)
+{
+	*hits = state->memo_hits;
+	*misses = state->memo_misses;
+}
+
+/************************************************************
+ *
+ * Clock Phases
+ *
+ ************************************************************/
+
+/*
+ * In a two-phase design, the clock level alone decides the value of
+ * many nodes for the whole phase: the clock buffers, and everything
+ * they pull down or precharge. When a transistor turns off, both of
+ * its sides are queued, but a side that is connected to GND through a
+ * transistor that is on will come out low no matter what, just like
+ * it already is - recalculating it is a waste.
+ *
+ * setClock() takes the nodes that stay high in each phase (the caller
+ * profiles them) and, for each phase, gives every "off" dependant a
+ * gate that should tie it to GND in that phase, or GND itself, which
+ * never reads as high. flip_node() tests that one bit before queueing
+ * the dependant, so the tables only select which transistor is worth
+ * looking at: if the profile is wrong, the node is just queued.
+ */
+
+static void
+free_clamps(state_t *state)
+{
+	free(state->phase_clamps[0]);
+	free(state->phase_clamps[1]);
+	state->phase_clamps[0] = NULL;
+	state->phase_clamps[1] = NULL;
+	state->clamps = NULL;
+}
+
+/*
+ * Build the per-phase tables for the clock node "clock": high[level]
+ * has the nodes that are expected to be high while the clock is at
+ * that level. setClockNode() switches between the tables.
+ */
+void
+setClock(state_t *state, nodenum_t clock, BOOL *high[2])
+{
+	count_t entries = state->nodes_dependant[state->nodes];
+
+	free_clamps(state);
+	/* the sentinel has to read as low */
+	set_nodes_value(state, state->vss, 0);
+
+	for (int level = 0; level < 2; level++) {
+		nodenum_t *clamps = malloc(entries * sizeof(*clamps));
+		for (nodenum_t nn = 0; nn < state->nodes; nn++) {
+			for (count_t g = state->nodes_dependant[nn]; g < state->nodes_dependant[nn+1]; g++) {
+				nodenum_t d = state->dependent_block[g];
+				clamps[g] = state->vss;
+				for (count_t t = state->nodes_c1c2offset[d]; t < state->nodes_c1c2offset[d+1]; t++) {
+					c1c2_t c = state->nodes_c1c2s[t];
+					if (c.other_node == state->vss && high[level][c.gate]) {
+						clamps[g] = c.gate;
+						break;
+					}
+				}
+			}
+		}
+		state->phase_clamps[level] = clamps;
+	}
+
+	state->clock = clock;
+	state->clamps = state->phase_clamps[get_nodes_value(state, clock)];
+}
+
+/************************************************************
+ *
+ * Tied Nodes
+ *
+ ************************************************************/
+
+/*
+ * Pins that are held at the same level for a whole session (IRQ, NMI,
+ * RDY, SO on most runs) make parts of the chip constant: a node that
+ * is pulled down by a transistor that is always on is always low, a
+ * pulled-up node whose transistors are all always off is always high,
+ * and so on. Transistors whose gate is always low can never connect
+ * anything, so tieNodes() removes them from the netlist that groups
+ * are collected from. Transistors that are always on stay, walking
+ * through them is what makes the group come out right.
+ *
+ * As soon as a tied node is driven to a different level, the next
+ * settle switches back to the complete netlist for good.
+ */
+
+static inline bitmap_t scatter_bits(const nodelist_group_t *g, unsigned int v);
+
+/*
+ * Propagate the seeds in "forced" (0, 1, or -1 for unknown) through the
+ * netlist. A node is low if a transistor that is always on connects it
+ * to GND ("hard"), or if it has no pullup and can only ever be connected
+ * to GND or to hard low nodes - then it keeps the low charge it has now.
+ */
+static void
+force_nodes(state_t *state, int8_t *forced)
+{
+	uint8_t *hard = calloc(state->nodes, 1);
+	BOOL changed;
+
+	do {
+		changed = NO;
+		for (nodenum_t nn = 0; nn < state->nodes; nn++) {
+			if (forced[nn] != -1 || nn == state->vss || nn == state->vcc)
+				continue;
+			BOOL pullup = get_nodes_pullup(state, nn) || get_bitmap(state->nodes_input, nn);
+			BOOL low = NO;
+			BOOL storage = !pullup && !get_nodes_value(state, nn);
+			BOOL high = pullup && !get_bitmap(state->nodes_input, nn);
+			for (count_t t = state->nodes_c1c2offset[nn]; t < state->nodes_c1c2offset[nn+1]; t++) {
+				c1c2_t c = state->nodes_c1c2s[t];
+				if (c.other_node == state->vss && forced[c.gate] == 1)
+					low = YES;
+				if (c.other_node != state->vcc && forced[c.gate] != 0)
+					high = NO;
+				if (c.other_node != state->vss && !hard[c.other_node] && forced[c.gate] != 0)
+					storage = NO;
+			}
+			if (low || high || storage) {
+				forced[nn] = high;
+				hard[nn] = low;
+				changed = YES;
+			}
+		}
+	} while (changed);
+	free(hard);
+}
+
+static void
+untie_nodes(state_t *state)
+{
+	if (state->tied)
+		destroyNodeList(state->tied);
+	state->tied = NULL;
+	if (!state->nodes_pruned)
+		return;
+
+	free(state->nodes_c1c2s);
+	free(state->nodes_c1c2offset);
+	free(state->nodes_pruned);
+	state->nodes_c1c2s = state->full_c1c2s;
+	state->nodes_c1c2offset = state->full_c1c2offset;
+	state->full_c1c2s = NULL;
+	state->full_c1c2offset = NULL;
+	state->nodes_pruned = NULL;
+
+	/* traces only guard the gates of the transistors they saw */
+	if (state->traces) {
+		for (unsigned int i = 0; i < state->trace_sets * TRACE_WAYS; i++)
+			state->traces[i].valid = NO;
+	}
+	flush_group_cache(state);
+}
+
+/* the same for values that changed without flip_node(): replayed settles, snapshots */
+static void
+check_pruned(state_t *state)
+{
+	if (!state->nodes_pruned)
+		return;
+	for (count_t i = 0; i < WORDS_FOR_BITS(state->nodes); i++) {
+		if (state->nodes_value[i] & state->nodes_pruned[i]) {
+			untie_nodes(state);
+			return;
+		}
+	}
+}
+
+/* have the tied nodes been driven to a different level? */
+static void
+check_tied(state_t *state)
+{
+	const nodelist_t *tied = state->tied;
+
+	for (int i = 0; i < tied->groupcount; i++) {
+		const nodelist_group_t *g = &tied->groups[i];
+		bitmap_t bits = scatter_bits(g, state->tied_value);
+		if ((state->nodes_pullup[g->word] & g->src) != bits ||
+			(state->nodes_pulldown[g->word] & g->src) != (g->src & ~bits)) {
+			untie_nodes(state);
+			return;
+		}
+	}
+}
+
+/*
+ * Remove the transistors whose gate is forced low, after checking that
+ * the settled chip agrees with "forced". Returns how many were removed,
+ * or -1.
+ */
+static int
+specialize(state_t *state, int8_t *forced)
+{
+	for (nodenum_t nn = 0; nn < state->nodes; nn++) {
+		if (forced[nn] != -1 && nn != state->vss && nn != state->vcc &&
+			forced[nn] != get_nodes_value(state, nn))
+			return -1;
+	}
+
+	count_t *offset = malloc((state->nodes + 1) * sizeof(*offset));
+	c1c2_t *c1c2s = malloc(state->nodes_c1c2offset[state->nodes] * sizeof(*c1c2s));
+	bitmap_t *pruned = calloc(WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t));
+	count_t used = 0;
+	for (nodenum_t nn = 0; nn < state->nodes; nn++) {
+		offset[nn] = used;
+		for (count_t t = state->nodes_c1c2offset[nn]; t < state->nodes_c1c2offset[nn+1]; t++) {
+			c1c2_t c = state->nodes_c1c2s[t];
+			if (forced[c.gate] != 0)
+				c1c2s[used++] = c;
+			else
+				set_bitmap(pruned, c.gate, 1);
+		}
+	}
+	offset[state->nodes] = used;
+
+	state->full_c1c2s = state->nodes_c1c2s;
+	state->full_c1c2offset = state->nodes_c1c2offset;
+	state->nodes_c1c2s = c1c2s;
+	state->nodes_c1c2offset = offset;
+	state->nodes_pruned = pruned;
+
+	/* cached groups test the gates at their positions in the old lists */
+	flush_group_cache(state);
+	return (state->full_c1c2offset[state->nodes] - used) / 2;
+}
+
+/*
+ * Specialize the netlist for the input nodes in nodelist (at most 32)
+ * staying at their current levels. Returns the number of transistors
+ * that were removed.
+ */
+int
+tieNodes(state_t *state, int count, nodenum_t *nodelist)
+{
+	int8_t *forced = malloc(state->nodes);
+	unsigned int value = 0;
+
+	untie_nodes(state);
+	memset(forced, -1, state->nodes);
+	for (int i = 0; i < count; i++) {
+		forced[nodelist[i]] = get_nodes_pullup(state, nodelist[i]);
+		value |= forced[nodelist[i]] << i;
+	}
+	force_nodes(state, forced);
+	int removed = specialize(state, forced);
+	free(forced);
+	if (removed < 0)
+		return 0;
+
+	state->tied = compileNodeList(state, count, nodelist);
+	state->tied_value = value;
+	return removed;
+}
+
+/*
+ * Profiling: remember every node that toggles from now on, until
+ * profiling is turned off again.
+ */
+void
+profileNodes(state_t *state, BOOL on)
+{
+	free(state->nodes_toggled);
+	state->nodes_toggled = on ? calloc(WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t)) : NULL;
+}
+
+/* the nodes that have not toggled while profiling, returns the count */
+int
+getFrozenNodes(state_t *state, nodenum_t *nodelist)
+{
+	int count = 0;
+
+	for (nodenum_t nn = 0; nn < state->nodes; nn++) {
+		if (nn != state->vss && nn != state->vcc && !get_bitmap(state->nodes_toggled, nn))
+			nodelist[count++] = nn;
+	}
+	return count;
+}
+
+/*
+ * Specialize the netlist for the nodes in nodelist (from a profile)
+ * keeping their current values, on top of the tied nodes. Unlike with
+ * tied pins, nothing keeps them from toggling, so every node that had
+ * transistors removed is watched: when it goes high, flip_node() puts
+ * back the complete netlist before anything is connected through them.
+ * Returns the number of transistors that were removed.
+ */
+int
+freezeNodes(state_t *state, int count, nodenum_t *nodelist)
+{
+	int8_t *forced = malloc(state->nodes);
+	nodelist_t *tied = state->tied;
+	unsigned int tied_value = state->tied_value;
+
+	memset(forced, -1, state->nodes);
+	for (int i = 0; tied && i < tied->count; i++)
+		forced[tied->nodes[i]] = (tied_value >> i) & 1;
+	for (int i = 0; i < count; i++)
+		forced[nodelist[i]] = get_nodes_value(state, nodelist[i]);
+
+	/* keep the tied nodes across untie_nodes() */
+	state->tied = NULL;
+	untie_nodes(state);
+	force_nodes(state, forced);
+	int removed = specialize(state, forced);
+	free(forced);
+	if (removed < 0) {
+		if (tied)
+			destroyNodeList(tied);
+		return 0;
+	}
+
+	state->tied = tied;
+	state->tied_value = tied_value;
+	return removed;
+}
+
+/************************************************************
+ *
+ * Initialization
+ *
+ ************************************************************/
+
+static inline void
+add_nodes_dependant(state_t *state, nodenum_t a, nodenum_t b, nodenum_t *counts, nodenum_t offset )
+{
+    /* O(N^2) behavior, but only run during initialization
+    NOTE - counts are still being set and cannot be calculated from offsets
+    */
+    nodenum_t *dependent_data = state->dependent_block + offset;
+    const nodenum_t dep_count = counts[a];
+	for (count_t g = 0; g < dep_count; g++)
+        if (dependent_data[g] == b)
+            return;
+
+	dependent_data[ counts[a]++ ] = b;
+}
+
+
+/*  6502:
+        3288 transistors, 3239 used in simulation after duplicate removal
+        1725 entries in node list and used in simulation
+        c1c2total = 6478
+        block_dep_size = 7260
+
+    Working set = 89 KB allocations, 220 KB binary, plus system libs and text buffering
+                = 604 KB in release build
+*/
+
+/* splitmix64 */
+static unsigned long long
+zobrist_key(unsigned long long x)
+{
+	x = (x + 1) * 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+state_t *
+setupNodesAndTransistors(netlist_transdefs *transdefs, BOOL *node_is_pullup, nodenum_t nodes, nodenum_t transistors, nodenum_t vss, nodenum_t vcc)
+{
+	/* allocate state */
+	/* everything not set up below starts out zero, like groupcount */
+	state_t *state = calloc(1, sizeof(state_t));
+	state->nodes = nodes;
+	state->transistors = transistors;
+	state->vss = vss;
+	state->vcc = vcc;
     
 	state->nodes_c1c2offset = calloc(state->nodes + 1, sizeof(*state->nodes_c1c2offset));
 	state->nodes_pullup = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->nodes_pullup));
 	state->nodes_pulldown = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->nodes_pulldown));
+	state->nodes_input = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->nodes_input));
 	state->nodes_value = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->nodes_value));
-	state->listout_bitmap = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->listout_bitmap));
+	state->nodes_layout = layout_bitmaps;
+	state->nodes_triples = NULL;
+	state->nodes_bytes = NULL;
+	state->nodes_zobrist = malloc(state->nodes * sizeof(*state->nodes_zobrist));
 	state->groupbitmap = calloc(WORDS_FOR_BITS(state->nodes), sizeof(*state->groupbitmap));
+	state->nodes_shadow = calloc(state->nodes, sizeof(*state->nodes_shadow));
+	state->nodes_shadow_bit = calloc(state->nodes, sizeof(*state->nodes_shadow_bit));
+	state->shadowcount = 0;
+	state->input_depth = 0;
  
     /* group content depends on active state, not easy to predict actual size needed */
 	state->group = calloc(state->nodes, sizeof(*state->group));
@@ -522,8 +1941,19 @@ setupNodesAndTransistors(netlist_transdefs *transdefs, BOOL *node_is_pullup, nod
 	state->list2 = calloc(state->nodes, sizeof(*state->list2));
 	state->listin.list = state->list1;
         state->listin.count = 0;
+	state->listin.bitmap = calloc(WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t));
+	state->listin.summary = calloc(SUMMARY_WORDS(state->nodes), sizeof(bitmap_t));
 	state->listout.list = state->list2;
         state->listout.count = 0;
+	state->listout.bitmap = calloc(WORDS_FOR_BITS(state->nodes), sizeof(bitmap_t));
+	state->listout.summary = calloc(SUMMARY_WORDS(state->nodes), sizeof(bitmap_t));
+	state->bitmap_scheduler = NO;
+	state->iterations = 0;
+	setKernels(state, NULL);
+	state->settled = calloc(state->nodes, sizeof(*state->settled));
+	state->epoch = 1;
+	state->floods_saved = 0;
+	state->group_cache = NULL;
     
     
     /* these are only used in initialization */
@@ -721,6 +2151,34 @@ setupNodesAndTransistors(netlist_transdefs *transdefs, BOOL *node_is_pullup, nod
 	}
 #endif
 
+	/* the same keys every time, so hashes can be compared across runs */
+	for (nodenum_t nn = 0; nn < state->nodes; nn++)
+		state->nodes_zobrist[nn] = zobrist_key(nn);
+	state->hash = 0;
+
+	state->memo = NULL;
+	state->memo_hand = NULL;
+	state->memo_before = NULL;
+
+	state->traces = NULL;
+	state->trace_hand = NULL;
+	state->trace_seen = NULL;
+	state->trace_credit = NULL;
+	state->trace_scratch = NULL;
+	state->trace_nodes = NULL;
+	state->trace_recording = NO;
+
+	state->clock = vss;
+	state->phase_clamps[0] = NULL;
+	state->phase_clamps[1] = NULL;
+	state->clamps = NULL;
+
+	state->tied = NULL;
+	state->full_c1c2s = NULL;
+	state->full_c1c2offset = NULL;
+	state->nodes_pruned = NULL;
+	state->nodes_toggled = NULL;
+
 	return state;
 }
 
@@ -729,25 +2187,235 @@ destroyNodesAndTransistors(state_t *state)
 {
     free(state->nodes_pullup);
     free(state->nodes_pulldown);
+    free(state->nodes_input);
     free(state->nodes_value);
+    free(state->nodes_triples);
+    free(state->nodes_bytes);
+    free(state->nodes_zobrist);
+    free(state->memo);
+    free(state->memo_hand);
+    free(state->memo_before);
+    free_traces(state);
+    free_clamps(state);
+    untie_nodes(state);
+    free(state->nodes_toggled);
     free(state->nodes_c1c2s);
     free(state->nodes_c1c2offset);
     free(state->dependent_block);
+    free(state->nodes_dependant);
+    free(state->nodes_left_dependant);
     free(state->list1);
     free(state->list2);
-    free(state->listout_bitmap);
+    free(state->listin.bitmap);
+    free(state->listin.summary);
+    free(state->listout.bitmap);
+    free(state->listout.summary);
+    free(state->settled);
+    free(state->group_cache);
     free(state->group);
     free(state->groupbitmap);
+    free(state->nodes_shadow);
+    free(state->nodes_shadow_bit);
     free(state);
 }
 
+/*
+ * Settle the network after inputs have changed - unless we are inside
+ * an input transaction, in which case this happens on commitInput().
+ */
+static inline void
+settle(state_t *state)
+{
+	if (!state->input_depth)
+		recalcNodeList(state);
+}
+
 void
 stabilizeChip(state_t *state)
 {
 	for (count_t i = 0; i < state->nodes; i++)
         listout_add(state, i);
 
-	recalcNodeList(state);
+	settle(state);
+}
+
+/*
+ * Choose how the nodes queued for each iteration are kept: in a list in
+ * the order they were queued (default), or only in the bitmaps, taken
+ * in node order with a summary of the non-zero words, so clearing is
+ * sparse. getIterations() counts the iterations of all settles.
+ */
+void
+setScheduler(state_t *state, BOOL bitmap)
+{
+	list_t *out = &state->listout;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+
+	/* the incoming side is not cleared by the list scheduler */
+	bitmap_clear(state->listin.bitmap, state->nodes);
+	memset(state->listin.summary, 0, SUMMARY_WORDS(state->nodes) * sizeof(bitmap_t));
+	state->listin.count = 0;
+
+	/* move whatever is queued over */
+	memset(out->summary, 0, SUMMARY_WORDS(state->nodes) * sizeof(bitmap_t));
+	out->count = 0;
+	for (count_t w = 0; w < words; w++) {
+		for (bitmap_t bits = out->bitmap[w]; bits; bits &= bits - 1) {
+			if (bitmap)
+				set_bitmap(out->summary, w, 1);
+			else
+				out->list[out->count] = w * BITMAP_BITS + __builtin_ctzll(bits);
+			out->count++;
+		}
+	}
+	state->bitmap_scheduler = bitmap;
+}
+
+unsigned long
+getIterations(state_t *state)
+{
+	return state->iterations;
+}
+
+/* one pointer for the chip layer, it owns what it points to */
+void
+setUserData(state_t *state, void *data)
+{
+	state->user_data = data;
+}
+
+void *
+getUserData(state_t *state)
+{
+	return state->user_data;
+}
+
+/*
+ * Pick the vector kernels by name ("scalar", "avx2", "avx512"), or the
+ * best ones the CPU supports for NULL. All of them give the same
+ * results. Returns NO if the CPU doesn't support them.
+ */
+BOOL
+setKernels(state_t *state, const char *name)
+{
+	const kernels_t *kernels = &kernels_scalar;
+#if HAVE_X86_KERNELS
+	BOOL avx2 = __builtin_cpu_supports("avx2") != 0;
+	BOOL avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+		__builtin_cpu_supports("avx512vl");
+
+	if (name ? !strcmp(name, "avx512") : avx512) {
+		if (!avx512)
+			return NO;
+		kernels = &kernels_avx512;
+	} else if (name ? !strcmp(name, "avx2") : avx2) {
+		if (!avx2)
+			return NO;
+		kernels = &kernels_avx2;
+	}
+#endif
+	if (name && strcmp(name, kernels->name))
+		return NO;
+	state->kernels = kernels;
+	return YES;
+}
+
+const char *
+getKernels(state_t *state)
+{
+	return state->kernels->name;
+}
+
+static const char *layout_names[layouts] = { "bitmaps", "interleaved", "bytes" };
+
+/*
+ * The group walk reads the value, pullup and pulldown bits of every
+ * member. They always live in the three bitmaps; "interleaved" keeps
+ * a copy with the three words for the same nodes next to each other,
+ * "bytes" one with a byte per node. Which one is fastest depends on
+ * the CPU, see tuneNodeLayout(). Returns NO for an unknown name.
+ */
+BOOL
+setNodeLayout(state_t *state, const char *name)
+{
+	const count_t words = WORDS_FOR_BITS(state->nodes);
+	layout_t layout;
+
+	for (layout = 0; layout < layouts; layout++)
+		if (!strcmp(name, layout_names[layout]))
+			break;
+	if (layout == layouts)
+		return NO;
+
+	free(state->nodes_triples);
+	free(state->nodes_bytes);
+	state->nodes_triples = layout == layout_interleaved ? malloc(3 * words * sizeof(bitmap_t)) : NULL;
+	state->nodes_bytes = layout == layout_bytes ? malloc(words * (BITMAP_MASK + 1)) : NULL;
+	state->nodes_layout = layout;
+	sync_nodes_layout(state, 0, words);
+	return YES;
+}
+
+const char *
+getNodeLayout(state_t *state)
+{
+	return layout_names[state->nodes_layout];
+}
+
+/* collect the group of every node, without changing anything */
+static void
+walk_all_groups(state_t *state)
+{
+	for (nodenum_t nn = 0; nn < state->nodes; nn++)
+		addAllNodesToGroup(state, nn);
+}
+
+/*
+ * Time the group walk over all nodes in every layout, and keep the
+ * fastest. Takes a few milliseconds, and the result depends on the
+ * timer, so this is only done on request; the default is "bitmaps".
+ */
+const char *
+tuneNodeLayout(state_t *state)
+{
+	const int rounds = 20;
+	layout_t best = layout_bitmaps;
+	clock_t best_time = 0;
+
+	for (layout_t layout = 0; layout < layouts; layout++) {
+		setNodeLayout(state, layout_names[layout]);
+		walk_all_groups(state);
+		clock_t start = clock();
+		for (int i = 0; i < rounds; i++)
+			walk_all_groups(state);
+		clock_t time = clock() - start;
+		if (layout == layout_bitmaps || time < best_time) {
+			best = layout;
+			best_time = time;
+		}
+	}
+	group_clear(state);
+	setNodeLayout(state, layout_names[best]);
+	return layout_names[best];
+}
+
+/*
+ * Input transactions: between beginInput() and commitInput(), setNode(),
+ * writeNodes() etc. only queue their changes, and the network is
+ * settled once on commit. Transactions can be nested.
+ */
+void
+beginInput(state_t *state)
+{
+	state->input_depth++;
+}
+
+void
+commitInput(state_t *state)
+{
+	assert(state->input_depth > 0);
+	if (!--state->input_depth)
+		recalcNodeList(state);
 }
 
 /************************************************************
@@ -761,9 +2429,23 @@ setNode(state_t *state, nodenum_t nn, BOOL s)
 {
     set_nodes_pullup(state, nn, s);
     set_nodes_pulldown(state, nn, !s);
+    set_bitmap(state->nodes_input, nn, 1);
     listout_add(state, nn);
 
-    recalcNodeList(state);
+    settle(state);
+}
+
+/*
+ * setNode() for a clock, which also picks the tables of setClock() for
+ * the new phase before the network settles. Setting the clock with
+ * plain setNode() is still correct, the old tables just skip less.
+ */
+void
+setClockNode(state_t *state, nodenum_t nn, BOOL s)
+{
+	if (state->phase_clamps[s] && nn == state->clock)
+		state->clamps = state->phase_clamps[s];
+	setNode(state, nn, s);
 }
 
 BOOL
@@ -789,6 +2471,174 @@ readNodes(state_t *state, int count, nodenum_t *nodelist)
 	return result;
 }
 
+/*
+ * Compile a node list (up to 32 nodes, LSB first) into groups of bits
+ * that share a bitmap word. With BMI2, a group is extracted with a
+ * single PEXT/PDEP pair, as long as the bits are in the same order in
+ * the bitmap word and in the value. Without it, all bits of a group
+ * have to move by the same distance, so a shift does the job.
+ */
+nodelist_t *
+compileNodeList(state_t *state, int count, nodenum_t *nodelist)
+{
+	assert(count <= 32);
+
+	nodelist_t *list = calloc(1, sizeof(nodelist_t));
+	list->count = count;
+	for (int i = 0; i < count; i++) {
+		nodenum_t nn = nodelist[i];
+		count_t word = nn >> BITMAP_SHIFT;
+		int bit = nn & BITMAP_MASK;
+		list->nodes[i] = nn;
+
+		/* find a group this bit fits in */
+		nodelist_group_t *g = NULL;
+		for (int j = 0; j < list->groupcount; j++) {
+			nodelist_group_t *c = &list->groups[j];
+			if (c->word != word)
+				continue;
+#if USE_PEXT
+			/* all earlier bits of the value must be lower in the word */
+			if ((c->src >> bit) == 0) {
+#else
+			if (c->shift == bit - i) {
+#endif
+				g = c;
+				break;
+			}
+		}
+		if (!g) {
+			g = &list->groups[list->groupcount++];
+			g->word = word;
+			g->src = 0;
+			g->dst = 0;
+			g->shift = bit - i;
+		}
+		g->src |= ONE << bit;
+		g->dst |= 1U << i;
+	}
+	return list;
+}
+
+void
+destroyNodeList(nodelist_t *list)
+{
+	free(list);
+}
+
+static inline unsigned int
+gather_bits(const nodelist_group_t *g, bitmap_t w)
+{
+#if USE_PEXT
+	return (unsigned int)_pdep_u64(_pext_u64(w, g->src), g->dst);
+#else
+	unsigned long long bits = w & g->src;
+	return (unsigned int)(g->shift >= 0 ? bits >> g->shift : bits << -g->shift);
+#endif
+}
+
+static inline bitmap_t
+scatter_bits(const nodelist_group_t *g, unsigned int v)
+{
+#if USE_PEXT
+	return (bitmap_t)_pdep_u64(_pext_u64(v, g->dst), g->src);
+#else
+	unsigned long long bits = v & g->dst;
+	return (bitmap_t)(g->shift >= 0 ? bits << g->shift : bits >> -g->shift);
+#endif
+}
+
+unsigned int
+readNodeList(state_t *state, nodelist_t *list)
+{
+	unsigned int result = 0;
+	for (int i = 0; i < list->groupcount; i++) {
+		const nodelist_group_t *g = &list->groups[i];
+		result |= gather_bits(g, state->nodes_value[g->word]);
+	}
+	return result;
+}
+
+void
+writeNodeList(state_t *state, nodelist_t *list, unsigned int v)
+{
+	for (int i = 0; i < list->groupcount; i++) {
+		const nodelist_group_t *g = &list->groups[i];
+		bitmap_t bits = scatter_bits(g, v);
+		state->nodes_pullup[g->word] = (state->nodes_pullup[g->word] & ~g->src) | bits;
+		state->nodes_pulldown[g->word] = (state->nodes_pulldown[g->word] & ~g->src) | (g->src & ~bits);
+		state->nodes_input[g->word] |= g->src;
+		sync_nodes_word(state, g->word);
+	}
+	for (int i = 0; i < list->count; i++)
+		listout_add(state, list->nodes[i]);
+	settle(state);
+}
+
+/*
+ * Force internal nodes (e.g. the bits of a register) to a value: drive
+ * them like inputs until the network has settled, then release them.
+ * They keep the value if the circuit holds it, like a latch or a
+ * floating node does. This always settles, even inside a transaction.
+ */
+void
+forceNodeList(state_t *state, nodelist_t *list, unsigned int v)
+{
+	bitmap_t pullup[32], pulldown[32];
+
+	for (int i = 0; i < list->groupcount; i++) {
+		const nodelist_group_t *g = &list->groups[i];
+		pullup[i] = state->nodes_pullup[g->word] & g->src;
+		pulldown[i] = state->nodes_pulldown[g->word] & g->src;
+		bitmap_t bits = scatter_bits(g, v);
+		state->nodes_pullup[g->word] = (state->nodes_pullup[g->word] & ~g->src) | bits;
+		state->nodes_pulldown[g->word] = (state->nodes_pulldown[g->word] & ~g->src) | (g->src & ~bits);
+		state->nodes_input[g->word] |= g->src;
+		sync_nodes_word(state, g->word);
+	}
+	for (int i = 0; i < list->count; i++)
+		listout_add(state, list->nodes[i]);
+	recalcNodeList(state);
+
+	for (int i = 0; i < list->groupcount; i++) {
+		const nodelist_group_t *g = &list->groups[i];
+		state->nodes_pullup[g->word] = (state->nodes_pullup[g->word] & ~g->src) | pullup[i];
+		state->nodes_pulldown[g->word] = (state->nodes_pulldown[g->word] & ~g->src) | pulldown[i];
+		sync_nodes_word(state, g->word);
+	}
+	for (int i = 0; i < list->count; i++)
+		listout_add(state, list->nodes[i]);
+	recalcNodeList(state);
+}
+
+/*
+ * Shadows are packed copies of node lists (up to 32 nodes) that are
+ * updated whenever one of the nodes changes, so reading a register
+ * or bus becomes a plain load. Every node can only be part of one shadow.
+ */
+int
+addShadow(state_t *state, int count, nodenum_t *nodelist)
+{
+	assert(state->shadowcount < MAX_SHADOWS);
+	assert(count <= 32);
+
+	int shadow = state->shadowcount++;
+	for (int i = 0; i < count; i++) {
+		nodenum_t nn = nodelist[i];
+		assert(!state->nodes_shadow[nn]);
+		state->nodes_shadow[nn] = shadow + 1;
+		state->nodes_shadow_bit[nn] = i;
+	}
+	state->shadows[shadow] = readNodes(state, count, nodelist);
+	return shadow;
+}
+
+unsigned int
+readShadow(state_t *state, int shadow)
+{
+	return state->shadows[shadow];
+}
+
 void
 writeNodes(state_t *state, int count, nodenum_t *nodelist, int v)
 {
@@ -797,7 +2647,85 @@ writeNodes(state_t *state, int count, nodenum_t *nodelist, int v)
 		BOOL s = v & 1;
 		set_nodes_pullup(state, nn, s);
 		set_nodes_pulldown(state, nn, !s);
+		set_bitmap(state->nodes_input, nn, 1);
 		listout_add(state, nn);
 	}
-	recalcNodeList(state);
+	settle(state);
+}
+
+/************************************************************
+ *
+ * Saving State
+ *
+ ************************************************************/
+
+/*
+ * A Zobrist hash of the node values: every node has a random key, and
+ * the hash is the XOR of the keys of all high nodes. recalcNode() keeps
+ * it up to date with one XOR per node that flips.
+ */
+unsigned long long
+stateHash(state_t *state)
+{
+	return state->hash;
+}
+
+/*
+ * The pullup/pulldown bitmaps (which hold the inputs) and the values
+ * decide everything the network will do, so two states with the same
+ * bitmaps behave the same from here on. The hash and the shadows are
+ * saved with them so restoring does not have to recompute anything.
+ * This only works between network settles, when nothing is queued.
+ */
+typedef struct {
+	unsigned long long hash;
+	unsigned int shadows[MAX_SHADOWS];
+	bitmap_t bitmaps[];     /* values, pullups, pulldowns */
+} saved_state_t;
+
+size_t
+stateSize(state_t *state)
+{
+	return sizeof(saved_state_t) + 3 * WORDS_FOR_BITS(state->nodes) * sizeof(bitmap_t);
+}
+
+void
+saveState(state_t *state, void *buf)
+{
+	saved_state_t *saved = buf;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	saved->hash = state->hash;
+	memcpy(saved->shadows, state->shadows, sizeof(saved->shadows));
+	memcpy(saved->bitmaps, state->nodes_value, words * sizeof(bitmap_t));
+	memcpy(saved->bitmaps + words, state->nodes_pullup, words * sizeof(bitmap_t));
+	memcpy(saved->bitmaps + 2 * words, state->nodes_pulldown, words * sizeof(bitmap_t));
+}
+
+void
+restoreState(state_t *state, const void *buf)
+{
+	const saved_state_t *saved = buf;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	state->hash = saved->hash;
+	memcpy(state->shadows, saved->shadows, sizeof(saved->shadows));
+	if (state->nodes_toggled) {
+		for (count_t i = 0; i < words; i++)
+			state->nodes_toggled[i] |= state->nodes_value[i] ^ saved->bitmaps[i];
+	}
+	memcpy(state->nodes_value, saved->bitmaps, words * sizeof(bitmap_t));
+	memcpy(state->nodes_pullup, saved->bitmaps + words, words * sizeof(bitmap_t));
+	memcpy(state->nodes_pulldown, saved->bitmaps + 2 * words, words * sizeof(bitmap_t));
+	if (state->nodes_layout != layout_bitmaps)
+		sync_nodes_layout(state, 0, words);
+	check_pruned(state);
+}
+
+BOOL
+sameState(state_t *state, const void *buf)
+{
+	const saved_state_t *saved = buf;
+	count_t words = WORDS_FOR_BITS(state->nodes);
+	return !memcmp(saved->bitmaps, state->nodes_value, words * sizeof(bitmap_t)) &&
+		!memcmp(saved->bitmaps + words, state->nodes_pullup, words * sizeof(bitmap_t)) &&
+		!memcmp(saved->bitmaps + 2 * words, state->nodes_pulldown, words * sizeof(bitmap_t));
 }
@@ -1,13 +1,51 @@
 #ifndef INCLUDED_FROM_NETLIST_SIM_C
 #define state_t void
+#define nodelist_t void
 #endif
 
 state_t *setupNodesAndTransistors(netlist_transdefs *transdefs, BOOL *node_is_pullup, nodenum_t nodes, nodenum_t transistors, nodenum_t vss, nodenum_t vcc);
 void destroyNodesAndTransistors(state_t *state);
 void setNode(state_t *state, nodenum_t nn, BOOL s);
+void setClockNode(state_t *state, nodenum_t nn, BOOL s);
 BOOL isNodeHigh(state_t *state, nodenum_t nn);
 unsigned int readNodes(state_t *state, int count, nodenum_t *nodelist);
 void writeNodes(state_t *state, int count, nodenum_t *nodelist, int v);
+nodelist_t *compileNodeList(state_t *state, int count, nodenum_t *nodelist);
+void destroyNodeList(nodelist_t *list);
+unsigned int readNodeList(state_t *state, nodelist_t *list);
+void writeNodeList(state_t *state, nodelist_t *list, unsigned int v);
+void forceNodeList(state_t *state, nodelist_t *list, unsigned int v);
+int addShadow(state_t *state, int count, nodenum_t *nodelist);
+unsigned int readShadow(state_t *state, int shadow);
 
 void recalcNodeList(state_t *state);
+void setMemo(state_t *state, unsigned int entries);
+void getMemoStats(state_t *state, unsigned long *hits, unsigned long *misses);
+void setTraces(state_t *state, unsigned int entries, int count, nodenum_t *nodelist);
+void getTraceStats(state_t *state, unsigned long *hits, unsigned long *misses);
+void setClock(state_t *state, nodenum_t clock, BOOL *high[2]);
+int tieNodes(state_t *state, int count, nodenum_t *nodelist);
+void profileNodes(state_t *state, BOOL on);
+int getFrozenNodes(state_t *state, nodenum_t *nodelist);
+int freezeNodes(state_t *state, int count, nodenum_t *nodelist);
+void setScheduler(state_t *state, BOOL bitmap);
+unsigned long getIterations(state_t *state);
+void setUserData(state_t *state, void *data);
+void *getUserData(state_t *state);
+BOOL setKernels(state_t *state, const char *name);
+const char *getKernels(state_t *state);
+BOOL setNodeLayout(state_t *state, const char *name);
+const char *getNodeLayout(state_t *state);
+const char *tuneNodeLayout(state_t *state);
+void cacheGroups(state_t *state, unsigned int entries);
+void getGroupStats(state_t *state, unsigned long *saved, unsigned long *hits, unsigned long *misses);
 void stabilizeChip(state_t *state);
+void beginInput(state_t *state);
+void commitInput(state_t *state);
+
+unsigned long long stateHash(state_t *state);
+unsigned long long stateKey(state_t *state);
+size_t stateSize(state_t *state);
+void saveState(state_t *state, void *buf);
+void restoreState(state_t *state, const void *buf);
+BOOL sameState(state_t *state, const void *buf);
@@ -21,8 +21,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "types.h"
 #include "netlist_sim.h"
+#include "perfect6502.h"
 /* nodes & transistors */
 #include "netlist_6502.h"
 
@@ -32,22 +35,99 @@
  *
  ************************************************************/
 
+/*
+ * With SHADOW_REGISTERS, the simulation keeps packed copies of all
+ * registers and buses up to date whenever one of their nodes changes,
+ * so reading them is a plain load instead of collecting bits.
+ */
+#define SHADOW_REGISTERS 1
+
+static nodenum_t nodes_ab[] = { ab0, ab1, ab2, ab3, ab4, ab5, ab6, ab7, ab8, ab9, ab10, ab11, ab12, ab13, ab14, ab15 };
+static nodenum_t nodes_db[] = { db0, db1, db2, db3, db4, db5, db6, db7 };
+static nodenum_t nodes_a[] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+static nodenum_t nodes_x[] = { x0, x1, x2, x3, x4, x5, x6, x7 };
+static nodenum_t nodes_y[] = { y0, y1, y2, y3, y4, y5, y6, y7 };
+static nodenum_t nodes_sp[] = { s0, s1, s2, s3, s4, s5, s6, s7 };
+static nodenum_t nodes_p[] = { p0, p1, p2, p3, p4, p5, p6, p7 };
+static nodenum_t nodes_notir[] = { notir0, notir1, notir2, notir3, notir4, notir5, notir6, notir7 };
+static nodenum_t nodes_pc[] = { pcl0, pcl1, pcl2, pcl3, pcl4, pcl5, pcl6, pcl7, pch0, pch1, pch2, pch3, pch4, pch5, pch6, pch7 };
+
+#define COUNT(nodelist) (sizeof(nodelist)/sizeof(*nodelist))
+
+enum {
+	REG_AB,
+	REG_DB,
+	REG_A,
+	REG_X,
+	REG_Y,
+	REG_SP,
+	REG_P,
+	REG_NOTIR,
+	REG_PC,
+	REG_COUNT
+};
+
+static struct {
+	nodenum_t *nodes;
+	int count;
+} registers[REG_COUNT] = {
+	{ nodes_ab, COUNT(nodes_ab) },
+	{ nodes_db, COUNT(nodes_db) },
+	{ nodes_a, COUNT(nodes_a) },
+	{ nodes_x, COUNT(nodes_x) },
+	{ nodes_y, COUNT(nodes_y) },
+	{ nodes_sp, COUNT(nodes_sp) },
+	{ nodes_p, COUNT(nodes_p) },
+	{ nodes_notir, COUNT(nodes_notir) },
+	{ nodes_pc, COUNT(nodes_pc) },
+};
+
+/* the same node lists, compiled for word-wise access */
+static nodelist_t *register_lists[REG_COUNT];
+
+#if SHADOW_REGISTERS
+#define READ_REGISTER(reg) readShadow(state, reg)
+#else
+#define READ_REGISTER(reg) readNodeList(state, register_lists[reg])
+#endif
+
+static void
+setupRegisters(void *state)
+{
+	for (int reg = 0; reg < REG_COUNT; reg++) {
+		register_lists[reg] = compileNodeList(state, registers[reg].count, registers[reg].nodes);
+#if SHADOW_REGISTERS
+		/* shadow handles are assigned in order, so they match the REG_* values */
+		addShadow(state, registers[reg].count, registers[reg].nodes);
+#endif
+	}
+}
+
+static void
+destroyRegisters(void)
+{
+	for (int reg = 0; reg < REG_COUNT; reg++) {
+		destroyNodeList(register_lists[reg]);
+		register_lists[reg] = NULL;
+	}
+}
+
 uint16_t
 readAddressBus(void *state)
 {
-	return (uint16_t)readNodes(state, 16, (nodenum_t[]){ ab0, ab1, ab2, ab3, ab4, ab5, ab6, ab7, ab8, ab9, ab10, ab11, ab12, ab13, ab14, ab15 });
+	return (uint16_t)READ_REGISTER(REG_AB);
 }
 
 uint8_t
 readDataBus(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ db0, db1, db2, db3, db4, db5, db6, db7 });
+	return (uint8_t)READ_REGISTER(REG_DB);
 }
 
 void
 writeDataBus(void *state, uint8_t d)
 {
-	writeNodes(state, 8, (nodenum_t[]){ db0, db1, db2, db3, db4, db5, db6, db7 }, d);
+	writeNodeList(state, register_lists[REG_DB], d);
 }
 
 BOOL
@@ -56,58 +136,126 @@ readRW(void *state)
 	return isNodeHigh(state, rw);
 }
 
+BOOL
+readSYNC(void *state)
+{
+	return isNodeHigh(state, sync_);
+}
+
 uint8_t
 readA(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ a0,a1,a2,a3,a4,a5,a6,a7 });
+	return (uint8_t)READ_REGISTER(REG_A);
 }
 
 uint8_t
 readX(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ x0,x1,x2,x3,x4,x5,x6,x7 });
+	return (uint8_t)READ_REGISTER(REG_X);
 }
 
 uint8_t
 readY(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ y0,y1,y2,y3,y4,y5,y6,y7 });
+	return (uint8_t)READ_REGISTER(REG_Y);
 }
 
 uint8_t
 readP(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ p0,p1,p2,p3,p4,p5,p6,p7 });
+	return (uint8_t)READ_REGISTER(REG_P);
 }
 
 uint8_t
 readIR(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ notir0,notir1,notir2,notir3,notir4,notir5,notir6,notir7 }) ^ 0xFF;
+	return (uint8_t)READ_REGISTER(REG_NOTIR) ^ 0xFF;
 }
 
 uint8_t
 readSP(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ s0,s1,s2,s3,s4,s5,s6,s7 });
+	return (uint8_t)READ_REGISTER(REG_SP);
+}
+
+uint16_t
+readPC(void *state)
+{
+	return (uint16_t)READ_REGISTER(REG_PC);
 }
 
 uint8_t
 readPCL(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ pcl0,pcl1,pcl2,pcl3,pcl4,pcl5,pcl6,pcl7 });
+	return (uint8_t)readPC(state);
 }
 
 uint8_t
 readPCH(void *state)
 {
-	return (uint8_t)readNodes(state, 8, (nodenum_t[]){ pch0,pch1,pch2,pch3,pch4,pch5,pch6,pch7 });
+	return (uint8_t)(readPC(state) >> 8);
 }
 
-uint16_t
-readPC(void *state)
+/************************************************************
+ *
+ * Register Injection
+ *
+ ************************************************************/
+
+/*
+ * Registers are forced through the nodes of their latches that float in
+ * phi1, i.e. that are only connected through a cclk transistor. For A,
+ * X and Y, these are the nodes we read them from. SP and the flags keep
+ * their values inverted on the other side of the latch; the flag nodes
+ * have no names in the netlist.
+ */
+static nodenum_t nodes_nots[] = { nots0, nots1, nots2, nots3, nots4, nots5, nots6, nots7 };
+static nodenum_t nodes_notp[] = { 1051, 1607, 1078, 99, 44, 1442 }; /* C, Z, I, D, V, N */
+
+static nodelist_t *list_nots;
+static nodelist_t *list_notp;
+
+static void
+setupInjection(void *state)
+{
+	list_nots = compileNodeList(state, COUNT(nodes_nots), nodes_nots);
+	list_notp = compileNodeList(state, COUNT(nodes_notp), nodes_notp);
+}
+
+static void
+destroyInjection(void)
+{
+	destroyNodeList(list_nots);
+	destroyNodeList(list_notp);
+	list_nots = list_notp = NULL;
+}
+
+/*
+ * Load all registers at an instruction boundary. The PC can only be
+ * changed by the chip itself, so it gets fed a JMP through the data bus
+ * (memory is not touched), and the other registers are forced in the
+ * last cycle of the JMP, after the previous instruction has written back
+ * its results. The 3 cycles of the JMP don't count in "cycle", and no
+ * events are run during them.
+ */
+void
+writeRegisters(void *state, uint8_t a, uint8_t x, uint8_t y, uint8_t sp, uint8_t p, uint16_t pc)
 {
-	return (uint16_t)((uint16_t)readPCH(state) << 8) | ((uint16_t)readPCL(state));
+	uint8_t jmp[] = { 0x4C, pc & 0xFF, pc >> 8 };
+
+	for (int i = 0; i < 6; i++) {
+		BOOL clk = isNodeHigh(state, clk0);
+		if (i == 4) {
+			forceNodeList(state, register_lists[REG_A], a);
+			forceNodeList(state, register_lists[REG_X], x);
+			forceNodeList(state, register_lists[REG_Y], y);
+			forceNodeList(state, list_nots, sp ^ 0xFF);
+			forceNodeList(state, list_notp, ((p & 0x0F) | (p >> 2 & 0x30)) ^ 0x3F);
+		}
+		setClockNode(state, clk0, !clk);
+		if (!clk)
+			writeDataBus(state, jmp[i / 2]);
+	}
 }
 
 /************************************************************
@@ -118,6 +266,193 @@ readPC(void *state)
 
 uint8_t memory[65536];
 
+/*
+ * Memory is part of the Zobrist hash (see chipStateHash()) with a key
+ * for every address/value pair. Writes by the chip keep it up to date,
+ * if the host changes memory directly, it has to call rehashMemory().
+ * That only marks the hash stale, so hosts can call it after every
+ * trap; it is recomputed when it is next read.
+ */
+static unsigned long long memory_hash;
+static BOOL memory_hash_stale;
+
+static inline unsigned long long
+memory_key(uint16_t a, uint8_t d)
+{
+	unsigned long long x = ((unsigned long long)a << 8 | d) * 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+void
+rehashMemory(void)
+{
+	memory_hash_stale = YES;
+}
+
+unsigned long long
+chipStateHash(void *state)
+{
+	if (memory_hash_stale) {
+		memory_hash = 0;
+		for (int a = 0; a < 65536; a++)
+			memory_hash ^= memory_key(a, memory[a]);
+		memory_hash_stale = NO;
+	}
+	return stateHash(state) ^ memory_hash;
+}
+
+/*
+ * Half-cycles often start from a state the chip has been in before, the
+ * memo cache (see netlist_sim.c) replays how the network settled then.
+ */
+void
+setMemoCache(void *state, unsigned int entries)
+{
+	setMemo(state, entries);
+}
+
+void
+readMemoStats(void *state, unsigned long *hits, unsigned long *misses)
+{
+	getMemoStats(state, hits, misses);
+}
+
+/*
+ * Traces (see netlist_sim.c) replay settles recorded for the same
+ * opcode, T-state and clock phase, guarded by every node they read.
+ */
+static nodenum_t nodes_trace[] = { notir0, notir1, notir2, notir3, notir4, notir5, notir6, notir7, clock1, clock2, t2, t3, t4, t5, clk0 };
+
+void
+setTraceCache(void *state, unsigned int entries)
+{
+	setTraces(state, entries, COUNT(nodes_trace), nodes_trace);
+}
+
+void
+readTraceStats(void *state, unsigned long *hits, unsigned long *misses)
+{
+	getTraceStats(state, hits, misses);
+}
+
+/* see cacheGroups() in netlist_sim.c */
+void
+setGroupCache(void *state, unsigned int entries)
+{
+	cacheGroups(state, entries);
+}
+
+void
+readGroupStats(void *state, unsigned long *saved, unsigned long *hits, unsigned long *misses)
+{
+	getGroupStats(state, saved, hits, misses);
+}
+
+/* see setScheduler() in netlist_sim.c */
+void
+setBitmapScheduler(void *state, BOOL on)
+{
+	setScheduler(state, on);
+}
+
+unsigned long
+readIterations(void *state)
+{
+	return getIterations(state);
+}
+
+/* see setKernels() in netlist_sim.c */
+BOOL
+selectKernels(void *state, const char *name)
+{
+	return setKernels(state, name);
+}
+
+const char *
+readKernels(void *state)
+{
+	return getKernels(state);
+}
+
+/* see setNodeLayout() in netlist_sim.c; "auto" times them, see tuneNodeLayout() */
+BOOL
+selectNodeLayout(void *state, const char *name)
+{
+	if (!strcmp(name, "auto")) {
+		tuneNodeLayout(state);
+		return YES;
+	}
+	return setNodeLayout(state, name);
+}
+
+const char *
+readNodeLayout(void *state)
+{
+	return getNodeLayout(state);
+}
+
+/*
+ * Specialize the netlist for RDY, SO, IRQ and NMI keeping their current
+ * values (see tieNodes() in netlist_sim.c). Driving one of them later
+ * puts the complete netlist back. Returns the number of transistors
+ * removed.
+ */
+int
+tieControlPins(void *state)
+{
+	nodenum_t pins[] = { rdy, so, irq, nmi };
+	return tieNodes(state, sizeof(pins)/sizeof(*pins), pins);
+}
+
+/*
+ * A node profile lists the nodes that did not toggle over a workload,
+ * one number per line. Loading it specializes the netlist for them
+ * staying constant (see freezeNodes() in netlist_sim.c); if one of them
+ * does toggle after all, the complete netlist comes back by itself.
+ */
+void
+startNodeProfile(void *state)
+{
+	profileNodes(state, YES);
+}
+
+/* returns the number of frozen nodes, or -1 */
+int
+saveNodeProfile(void *state, const char *filename)
+{
+	nodenum_t nodes[COUNT(netlist_6502_node_is_pullup)];
+	int count = getFrozenNodes(state, nodes);
+
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	for (int i = 0; i < count; i++)
+		fprintf(f, "%d\n", nodes[i]);
+	fclose(f);
+	return count;
+}
+
+/* returns the number of transistors removed, or -1 */
+int
+loadNodeProfile(void *state, const char *filename)
+{
+	nodenum_t nodes[COUNT(netlist_6502_node_is_pullup)];
+	int count = 0;
+	int nn;
+
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		return -1;
+	while (count < COUNT(nodes) && fscanf(f, "%d", &nn) == 1) {
+		if (nn >= 0 && nn < COUNT(nodes))
+			nodes[count++] = nn;
+	}
+	fclose(f);
+	return freezeNodes(state, count, nodes);
+}
+
 static uint8_t
 mRead(uint16_t a)
 {
@@ -127,6 +462,7 @@ mRead(uint16_t a)
 static void
 mWrite(uint16_t a, uint8_t d)
 {
+	memory_hash ^= memory_key(a, memory[a]) ^ memory_key(a, d);
 	memory[a] = d;
 }
 
@@ -139,6 +475,411 @@ handleMemory(void *state)
 		mWrite(readAddressBus(state), readDataBus(state));
 }
 
+/************************************************************
+ *
+ * Scheduled Pin Events
+ *
+ ************************************************************/
+
+/*
+ * Pin changes and callbacks are kept in a timer wheel indexed by the
+ * half-cycle they are due in. Events more than EVENT_WHEEL_SIZE
+ * half-cycles in the future share a slot with nearer ones and are
+ * skipped until their time has come.
+ */
+#define EVENT_WHEEL_SIZE 256
+#define EVENT_WHEEL_MASK (EVENT_WHEEL_SIZE - 1)
+
+typedef struct event {
+	struct event *next;
+	unsigned long when;
+	int pin;                    /* -1 for callbacks */
+	BOOL value;
+	event_callback callback;
+	void *context;
+} event_t;
+
+/* per chip, kept with setUserData() */
+typedef struct {
+	event_t *wheel[EVENT_WHEEL_SIZE];
+	event_t *free;
+	int pending;
+	unsigned long run;      /* so the instruction cache can tell */
+} events_t;
+
+static inline events_t *
+chip_events(void *state)
+{
+	return getUserData(state);
+}
+
+static nodenum_t pin_nodes[] = {
+	[PIN_RES] = res,
+	[PIN_IRQ] = irq,
+	[PIN_NMI] = nmi,
+	[PIN_RDY] = rdy,
+	[PIN_SO] = so,
+};
+
+static void
+add_event(events_t *events, event_t *e)
+{
+	/* events in the past happen on the next step */
+	if (e->when < cycle)
+		e->when = cycle;
+
+	/* append, so events for the same half-cycle keep their order */
+	event_t **p = &events->wheel[e->when & EVENT_WHEEL_MASK];
+	while (*p)
+		p = &(*p)->next;
+	e->next = NULL;
+	*p = e;
+	events->pending++;
+}
+
+static event_t *
+new_event(events_t *events, unsigned long halfcycle)
+{
+	event_t *e = events->free;
+	if (e)
+		events->free = e->next;
+	else
+		e = malloc(sizeof(event_t));
+	e->when = halfcycle;
+	return e;
+}
+
+/* drive one of the input pins at the beginning of the given half-cycle */
+void
+schedulePin(void *state, unsigned long halfcycle, int pin, BOOL value)
+{
+	event_t *e = new_event(chip_events(state), halfcycle);
+	e->pin = pin;
+	e->value = value;
+	e->callback = NULL;
+	add_event(chip_events(state), e);
+}
+
+/*
+ * Call back at the beginning of the given half-cycle. The callback runs
+ * inside the input transaction of the clock edge, so any pins or data
+ * bus values it sets are settled together with it.
+ */
+void
+scheduleCallback(void *state, unsigned long halfcycle, event_callback callback, void *context)
+{
+	event_t *e = new_event(chip_events(state), halfcycle);
+	e->pin = -1;
+	e->callback = callback;
+	e->context = context;
+	add_event(chip_events(state), e);
+}
+
+/* the earliest half-cycle with a pending event, or ~0 if there is none */
+unsigned long
+nextEventCycle(void *state)
+{
+	events_t *events = chip_events(state);
+	unsigned long next = ~0UL;
+	if (!events->pending)
+		return next;
+	for (int i = 0; i < EVENT_WHEEL_SIZE; i++)
+		for (event_t *e = events->wheel[i]; e; e = e->next)
+			if (e->when < next)
+				next = e->when;
+	return next;
+}
+
+static void
+run_events(void *state, events_t *events)
+{
+	/* unlink everything that is due first, callbacks may add events */
+	event_t *due = NULL, **tail = &due;
+	event_t **p = &events->wheel[cycle & EVENT_WHEEL_MASK];
+	while (*p) {
+		event_t *e = *p;
+		if (e->when == cycle) {
+			*p = e->next;
+			*tail = e;
+			tail = &e->next;
+			events->pending--;
+			events->run++;
+		} else {
+			p = &e->next;
+		}
+	}
+	*tail = NULL;
+
+	while (due) {
+		event_t *e = due;
+		due = e->next;
+		if (e->pin >= 0)
+			setNode(state, pin_nodes[e->pin], e->value);
+		else
+			e->callback(state, e->context);
+		e->next = events->free;
+		events->free = e;
+	}
+}
+
+static void
+destroy_events(events_t *events)
+{
+	for (int i = 0; i < EVENT_WHEEL_SIZE; i++) {
+		while (events->wheel[i]) {
+			event_t *e = events->wheel[i];
+			events->wheel[i] = e->next;
+			free(e);
+		}
+	}
+	while (events->free) {
+		event_t *e = events->free;
+		events->free = e->next;
+		free(e);
+	}
+	free(events);
+}
+
+/************************************************************
+ *
+ * Quiescent Loops
+ *
+ ************************************************************/
+
+/*
+ * A program that waits for something by polling memory ("LDA $D011 /
+ * BPL *-3") goes through the same states over and over until the
+ * outside world changes. With loop skipping on, stepInstruction()
+ * saves the chip state at an instruction boundary and records what
+ * the following instructions read. If the chip comes back to the same
+ * state without having written anything, and memory still holds what
+ * was read, all further iterations are identical: instead of
+ * simulating them, "cycle" is advanced by as many whole iterations as
+ * fit before the next scheduled event or the limit.
+ *
+ * The host can still change memory between calls to stepInstruction(),
+ * which is what the footprint check is for, and the limit keeps one
+ * call from jumping further ahead than the host can tolerate.
+ */
+#define LOOP_MAX_INSTRUCTIONS 32
+
+static unsigned long loop_limit;        /* 0: off */
+static void *loop_start;                /* chip state at the start of the loop */
+static unsigned long long loop_hash;    /* and its hash, to rule out most boundaries */
+static BOOL loop_valid;
+static unsigned long loop_cycle;
+static int loop_instructions;
+static int loop_reads;
+static bus_cycle loop_footprint[LOOP_MAX_INSTRUCTIONS * MAX_INSTR_CYCLES];  /* only whole instructions */
+
+unsigned long skipped_cycles;
+
+/* skip at most "limit" half-cycles per call to stepInstruction(), 0 turns skipping off */
+void
+setLoopSkipping(void *state, unsigned long limit)
+{
+	loop_limit = limit;
+	loop_valid = NO;
+	if (limit && !loop_start)
+		loop_start = malloc(stateSize(state));
+}
+
+static void
+start_loop(void *state)
+{
+	saveState(state, loop_start);
+	loop_hash = stateHash(state);
+	loop_valid = YES;
+	loop_cycle = cycle;
+	loop_instructions = 0;
+	loop_reads = 0;
+}
+
+static void
+skip_loop(void *state, const instr_info *info)
+{
+	/* a write ends it, the next boundary is a new candidate */
+	for (int i = 0; i < info->cycles; i++) {
+		if (!info->bus[i].rw) {
+			loop_valid = NO;
+			return;
+		}
+	}
+	if (!loop_valid || loop_instructions == LOOP_MAX_INSTRUCTIONS) {
+		start_loop(state);
+		return;
+	}
+
+	for (int i = 0; i < info->cycles; i++)
+		loop_footprint[loop_reads++] = info->bus[i];
+	loop_instructions++;
+
+	if (stateHash(state) != loop_hash || !sameState(state, loop_start))
+		return;
+
+	for (int i = 0; i < loop_reads; i++) {
+		if (memory[loop_footprint[i].address] != loop_footprint[i].data) {
+			start_loop(state);
+			return;
+		}
+	}
+
+	unsigned long period = cycle - loop_cycle;
+	unsigned long until = nextEventCycle(state);
+	if (until - cycle > loop_limit)
+		until = cycle + loop_limit;
+	unsigned long skip = (until - cycle) / period * period;
+	cycle += skip;
+	skipped_cycles += skip;
+
+	/* we are at the start of the loop again */
+	loop_cycle = cycle;
+	loop_instructions = 0;
+	loop_reads = 0;
+}
+
+static void
+destroy_loop(void)
+{
+	free(loop_start);
+	loop_start = NULL;
+	loop_limit = 0;
+	loop_valid = NO;
+}
+
+/************************************************************
+ *
+ * Snapshots and Instruction Cache
+ *
+ ************************************************************/
+
+/*
+ * A snapshot holds the complete state of the chip, but neither memory
+ * nor "cycle", which belong to the host. It can only be taken and
+ * restored between half-cycles, which is everywhere outside step().
+ */
+size_t
+chipStateSize(void *state)
+{
+	return stateSize(state);
+}
+
+void
+saveChipState(void *state, void *buf)
+{
+	saveState(state, buf);
+}
+
+void
+restoreChipState(void *state, const void *buf)
+{
+	restoreState(state, buf);
+}
+
+/*
+ * Starting from a given chip state (node values and inputs, see
+ * stateKey()), an instruction only depends on the data it reads. The
+ * instruction cache records the bus cycles of every instruction that
+ * stepInstruction() simulates, together with a snapshot of the state
+ * it ends in. When the chip is in the same state again and memory
+ * still returns the same data for all reads, the instruction is
+ * replayed instead: its writes are done, and the chip jumps to the
+ * final state. Instructions that had events run, or would have one
+ * run, are always simulated.
+ */
+typedef struct {
+	unsigned long long key;
+	BOOL valid;
+	int steps;              /* half-cycles */
+	instr_info info;
+	unsigned long long state[];     /* saveState() */
+} icache_entry_t;
+
+static uint8_t *icache;
+static size_t icache_entry_size;
+static unsigned int icache_entries;
+static unsigned long icache_hits;
+static unsigned long icache_misses;
+
+static inline icache_entry_t *
+icache_entry(unsigned long long key)
+{
+	return (icache_entry_t *)(icache + (key & (icache_entries - 1)) * icache_entry_size);
+}
+
+static BOOL
+icache_replay(void *state, unsigned long long key, instr_info *info)
+{
+	icache_entry_t *e = icache_entry(key);
+	if (!e->valid || e->key != key)
+		return NO;
+
+	/* reads see memory as it is, or as the instruction has written it */
+	for (int i = 0; i < e->info.cycles; i++) {
+		const bus_cycle *b = &e->info.bus[i];
+		if (!b->rw)
+			continue;
+		uint8_t d = memory[b->address];
+		for (int j = i - 1; j >= 0; j--) {
+			if (!e->info.bus[j].rw && e->info.bus[j].address == b->address) {
+				d = e->info.bus[j].data;
+				break;
+			}
+		}
+		if (d != b->data)
+			return NO;
+	}
+	if (nextEventCycle(state) < cycle + e->steps)
+		return NO;
+
+	for (int i = 0; i < e->info.cycles; i++)
+		if (!e->info.bus[i].rw)
+			mWrite(e->info.bus[i].address, e->info.bus[i].data);
+	restoreState(state, e->state);
+	cycle += e->steps;
+	*info = e->info;
+	icache_hits++;
+	return YES;
+}
+
+static void
+icache_record(void *state, unsigned long long key, const instr_info *info, int steps)
+{
+	icache_entry_t *e = icache_entry(key);
+	e->key = key;
+	e->valid = YES;
+	e->steps = steps;
+	e->info = *info;
+	saveState(state, e->state);
+	icache_misses++;
+}
+
+/* cache up to "entries" instructions (rounded down to a power of two), 0 turns it off */
+void
+setInstructionCache(void *state, unsigned int entries)
+{
+	free(icache);
+	icache = NULL;
+	icache_entries = 0;
+	icache_hits = 0;
+	icache_misses = 0;
+	if (!entries)
+		return;
+
+	icache_entries = 1;
+	while (icache_entries * 2 <= entries)
+		icache_entries *= 2;
+	icache_entry_size = sizeof(icache_entry_t) + (stateSize(state) + 7) / 8 * 8;
+	icache = calloc(icache_entries, icache_entry_size);
+}
+
+void
+readInstructionCacheStats(void *state, unsigned long *hits, unsigned long *misses)
+{
+	*hits = icache_hits;
+	*misses = icache_misses;
+}
+
 /************************************************************
  *
  * Main Clock Loop
@@ -151,10 +892,14 @@ void
 step(void *state)
 {
 	BOOL clk = isNodeHigh(state, clk0);
+	events_t *events = chip_events(state);
 
-	/* invert clock */
-	setNode(state, clk0, !clk);
-	recalcNodeList(state);
+	/* invert clock, together with all pin changes due now */
+	beginInput(state);
+	if (events->pending)
+		run_events(state, events);
+	setClockNode(state, clk0, !clk);
+	commitInput(state);
 
 	/* handle memory reads and writes */
 	if (!clk)
@@ -163,6 +908,80 @@ step(void *state)
 	cycle++;
 }
 
+/*
+ * Run until the chip is about to fetch the next opcode, i.e. SYNC is
+ * high in phi1. Every memory cycle on the way is recorded, so if we
+ * start at such a boundary, "info" describes exactly one instruction.
+ * We give up after MAX_INSTR_CYCLES, so a JAMmed CPU does not hang us.
+ * Returns NO unless "info" is such a whole instruction.
+ */
+static BOOL
+run_instruction(void *state, instr_info *info)
+{
+	BOOL fetched = NO;
+
+	info->opcode = 0;
+	info->pc = 0;
+	info->cycles = 0;
+
+	for (;;) {
+		step(state);
+
+		if (isNodeHigh(state, clk0)) {
+			/* phi2: the memory access has just been done */
+			if (info->cycles < MAX_INSTR_CYCLES) {
+				bus_cycle *b = &info->bus[info->cycles];
+				b->address = readAddressBus(state);
+				b->data = readDataBus(state);
+				b->rw = readRW(state);
+				if (!info->cycles && isNodeHigh(state, sync_)) {
+					info->opcode = b->data;
+					info->pc = b->address;
+					fetched = YES;
+				}
+			}
+			if (++info->cycles == MAX_INSTR_CYCLES)
+				return NO;
+		} else {
+			/* phi1: SYNC announces the next opcode fetch */
+			if (info->cycles && isNodeHigh(state, sync_))
+				return fetched;
+		}
+	}
+}
+
+/*
+ * Returns NO if the chip was not at an instruction boundary (there
+ * was no opcode fetch, opcode and pc are 0), or if the instruction
+ * did not end within MAX_INSTR_CYCLES.
+ */
+BOOL
+stepInstruction(void *state, instr_info *info)
+{
+	BOOL whole = YES;
+
+	if (!icache) {
+		whole = run_instruction(state, info);
+	} else {
+		unsigned long long key = stateKey(state);
+		if (!icache_replay(state, key, info)) {
+			unsigned long start = cycle, events = chip_events(state)->run;
+			whole = run_instruction(state, info);
+			if (events == chip_events(state)->run && whole)
+				icache_record(state, key, info, cycle - start);
+		}
+	}
+
+	/* only whole instructions can be part of a loop */
+	if (loop_limit) {
+		if (whole)
+			skip_loop(state, info);
+		else
+			loop_valid = NO;
+	}
+	return whole;
+}
+
 void *
 initAndResetChip(void)
 {
@@ -175,25 +994,40 @@ initAndResetChip(void)
 										   transistors,
 										   vss,
 										   vcc);
+	setUserData(state, calloc(1, sizeof(events_t)));
+	setupRegisters(state);
+	setupInjection(state);
 
+	/* set all inputs and settle the network once */
+	beginInput(state);
 	setNode(state, res, 0);
 	setNode(state, clk0, 1);
 	setNode(state, rdy, 1);
 	setNode(state, so, 0);
 	setNode(state, irq, 1);
 	setNode(state, nmi, 1);
-
 	stabilizeChip(state);
+	commitInput(state);
 
-	/* hold RESET for 8 cycles */
-	for (int i = 0; i < 16; i++)
+	/* hold RESET for 8 cycles, and see which nodes stay high in each clock phase */
+	BOOL *high[2] = { malloc(nodes * sizeof(BOOL)), malloc(nodes * sizeof(BOOL)) };
+	for (nodenum_t nn = 0; nn < nodes; nn++)
+		high[0][nn] = high[1][nn] = YES;
+	for (int i = 0; i < 16; i++) {
 		step(state);
+		BOOL clk = isNodeHigh(state, clk0);
+		for (nodenum_t nn = 0; nn < nodes; nn++)
+			high[clk][nn] &= isNodeHigh(state, nn);
+	}
+	setClock(state, clk0, high);
+	free(high[0]);
+	free(high[1]);
 
 	/* release RESET */
 	setNode(state, res, 1);
-	recalcNodeList(state);
 
 	cycle = 0;
+	rehashMemory();
 
 	return state;
 }
@@ -201,6 +1035,11 @@ initAndResetChip(void)
 void
 destroyChip(void *state)
 {
+    destroy_events(chip_events(state));
+    destroy_loop();
+    setInstructionCache(state, 0);
+    destroyRegisters();
+    destroyInjection();
     destroyNodesAndTransistors(state);
 }
 
@@ -2,22 +2,93 @@
 #define state_t void
 #endif
 
+/*
+ * the longest instruction (or interrupt sequence) takes 7 cycles;
+ * stepInstruction() records at most this many, so it returns from
+ * a JAMmed CPU
+ */
+#define MAX_INSTR_CYCLES 16
+
+typedef struct {
+	unsigned short address;
+	unsigned char data;
+	unsigned char rw;
+} bus_cycle;
+
+typedef struct {
+	unsigned char opcode;
+	unsigned short pc;
+	int cycles;
+	bus_cycle bus[MAX_INSTR_CYCLES];
+} instr_info;
+
+/* input pins that can be driven by scheduled events */
+enum {
+	PIN_RES,
+	PIN_IRQ,
+	PIN_NMI,
+	PIN_RDY,
+	PIN_SO
+};
+
+typedef void (*event_callback)(state_t *state, void *context);
+
 extern state_t *initAndResetChip(void);
 extern void destroyChip(state_t *state);
 extern void step(state_t *state);
+extern unsigned char stepInstruction(state_t *state, instr_info *info);
+extern void schedulePin(state_t *state, unsigned long halfcycle, int pin, unsigned char value);
+extern void scheduleCallback(state_t *state, unsigned long halfcycle, event_callback callback, void *context);
+extern unsigned long nextEventCycle(state_t *state);
+/*
+ * Only scheduled events stop a skip: memory the host changes between
+ * calls to stepInstruction() is only seen afterwards, so "limit" has to
+ * be as small as the host needs to see its writes in time.
+ */
+extern void setLoopSkipping(state_t *state, unsigned long limit);
 extern void chipStatus(state_t *state);
+/*
+ * chipStateHash() covers memory, and follows the writes of the chip
+ * only: call rehashMemory() after writing to memory[] directly.
+ */
+extern unsigned long long chipStateHash(state_t *state);
+extern void rehashMemory(void);
+extern void setMemoCache(state_t *state, unsigned int entries);
+extern void readMemoStats(state_t *state, unsigned long *hits, unsigned long *misses);
+extern void setTraceCache(state_t *state, unsigned int entries);
+extern void readTraceStats(state_t *state, unsigned long *hits, unsigned long *misses);
+extern void setBitmapScheduler(state_t *state, unsigned char on);
+extern void setGroupCache(state_t *state, unsigned int entries);
+extern void readGroupStats(state_t *state, unsigned long *saved, unsigned long *hits, unsigned long *misses);
+extern unsigned long readIterations(state_t *state);
+extern unsigned char selectKernels(state_t *state, const char *name);
+extern const char *readKernels(state_t *state);
+extern unsigned char selectNodeLayout(state_t *state, const char *name);
+extern const char *readNodeLayout(state_t *state);
+extern int tieControlPins(state_t *state);
+extern void startNodeProfile(state_t *state);
+extern int saveNodeProfile(state_t *state, const char *filename);
+extern int loadNodeProfile(state_t *state, const char *filename);
+extern size_t chipStateSize(state_t *state);
+extern void saveChipState(state_t *state, void *buf);
+extern void restoreChipState(state_t *state, const void *buf);
+extern void setInstructionCache(state_t *state, unsigned int entries);
+extern void readInstructionCacheStats(state_t *state, unsigned long *hits, unsigned long *misses);
 extern unsigned short readPC(state_t *state);
 extern unsigned char readA(state_t *state);
 extern unsigned char readX(state_t *state);
 extern unsigned char readY(state_t *state);
 extern unsigned char readSP(state_t *state);
 extern unsigned char readP(state_t *state);
-extern unsigned int readRW(state_t *state);
+extern unsigned char readRW(state_t *state);
+extern unsigned char readSYNC(state_t *state);
 extern unsigned short readAddressBus(state_t *state);
 extern void writeDataBus(state_t *state, unsigned char);
+extern void writeRegisters(state_t *state, unsigned char a, unsigned char x, unsigned char y, unsigned char sp, unsigned char p, unsigned short pc);
 extern unsigned char readDataBus(state_t *state);
 extern unsigned char readIR(state_t *state);
 
 extern unsigned char memory[65536];
 extern unsigned long cycle;
+extern unsigned long skipped_cycles;
 //extern unsigned int transistors;
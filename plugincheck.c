@@ -0,0 +1,341 @@
+/*
+ * Compare the native fast paths of the BASIC plugin (cbmbasic/plugin.c)
+ * against the ROM code they replace, run on the functional 6502
+ * (cbmbasic/emu.c, which compare.c checks against the transistors):
+ *
+ * 1. CRNCH, the tokenizer, on random lines of keywords, strings, REM,
+ *    DATA and shifted characters
+ * 2. EVAL, on random terms: float variables that exist, which the
+ *    native code handles, and everything it has to leave to the ROM
+ *
+ * Where the native version handles a call, the registers, N, Z and C
+ * and all memory (except the stack below the return address) have to
+ * be the same as after the ROM code. Where it gives up, memory and the
+ * registers have to be unchanged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "perfect6502.h"
+#include "cbmbasic/runtime_init.h"
+#include "cbmbasic/emu.h"
+#include "cbmbasic/plugin.h"
+
+#define CRNCH_TRIALS 20000
+#define EVAL_TRIALS 20000
+#define MAX_INSTRUCTIONS 100000
+#define MAX_LINE 72
+#define STOP 0x0400             /* where the routines return to */
+#define VARIABLES 0x0900        /* VARTAB */
+#define MAX_VARIABLES 16
+
+/* the registers at a trap, normally in cbmbasic/runtime_init.c */
+unsigned char A, X, Y, S, P;
+unsigned short PC;
+int N, Z, C;
+
+/* runtime.c registers its KERNAL traps, which are not needed here */
+void
+register_trap(unsigned short address, trap_handler handler)
+{
+}
+
+/* only the plugin's statements run 6502 code on behalf of the plugin */
+void
+monitor_call(unsigned short pc, unsigned short ret)
+{
+	printf("monitor_call($%04X) from a native path\n", pc);
+	exit(1);
+}
+
+static uint8_t before[65536];
+static uint8_t after[65536];
+static int errors;
+
+/* CHRGET, as BASIC copies it to the zero page at startup */
+static const uint8_t chrget[] = {
+	0xE6, 0x7A, 0xD0, 0x02, 0xE6, 0x7B, 0xAD, 0x00, 0x02, 0xC9, 0x3A, 0xB0,
+	0x0A, 0xC9, 0x20, 0xF0, 0xEF, 0x38, 0xE9, 0x30, 0x38, 0xE9, 0xD0, 0x60
+};
+
+static void
+setup_basic()
+{
+	FILE *f = fopen("cbmbasic/cbmbasic.bin", "rb");
+	if (f == NULL) {
+		perror("Error opening cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+	memset(memory, 0, 65536);
+	size_t readlen = fread(memory + 0xA000, 1, 17591, f);
+	fclose(f);
+	if (readlen != 17591) {
+		perror("Error reading cbmbasic/cbmbasic.bin");
+		exit(1);
+	}
+	memcpy(memory + 0x73, chrget, sizeof(chrget));
+}
+
+/* run a ROM routine up to its RTS to STOP; NO on BASIC errors */
+static BOOL
+rom(unsigned short address, emu_registers *r)
+{
+	instr_info info;
+
+	memory[0x100 | r->s] = (STOP - 1) >> 8;
+	memory[0x100 | (uint8_t)(r->s - 1)] = (STOP - 1) & 0xFF;
+	r->s -= 2;
+	r->pc = address;
+	emu_memory = memory;
+	emu_set_registers(r);
+	for (int i = 0; i < MAX_INSTRUCTIONS; i++) {
+		emu_get_registers(r);
+		if (r->pc == STOP)
+			return YES;
+		if (r->pc == 0xA437 || !emu_step_instruction(&info))
+			return NO;
+	}
+	return NO;
+}
+
+static void
+error(const char *name, const char *what)
+{
+	printf("%s: %s, text:", name, what);
+	for (int i = 0; i < MAX_LINE && before[0x0200 + i]; i++)
+		printf(" %02X", before[0x0200 + i]);
+	printf("\n");
+	errors++;
+}
+
+/*
+ * Run the ROM code at "address" and the native hook "native" from the
+ * same memory and registers (set up by the caller), and compare them.
+ * Returns YES if the native code handled the call.
+ */
+static BOOL
+test_call(const char *name, unsigned short address, unsigned short (*native)(void), const emu_registers *r)
+{
+	emu_registers r_rom = *r;
+
+	memcpy(before, memory, sizeof(before));
+	BOOL ok = rom(address, &r_rom);
+	memcpy(after, memory, sizeof(after));
+
+	/* the native version, as the plugin vector would call it */
+	memcpy(memory, before, sizeof(before));
+	memory[0x100 | r->s] = (STOP - 1) >> 8;
+	memory[0x100 | (uint8_t)(r->s - 1)] = (STOP - 1) & 0xFF;
+	A = r->a;
+	X = r->x;
+	Y = r->y;
+	S = r->s - 2;
+	P = r->p;
+	N = P >> 7;
+	Z = (P >> 1) & 1;
+	C = P & 1;
+	unsigned short pc = native();
+	if (!pc) {
+		memory[0x100 | r->s] = before[0x100 | r->s];
+		memory[0x100 | (uint8_t)(r->s - 1)] = before[0x100 | (uint8_t)(r->s - 1)];
+		if (memcmp(memory, before, sizeof(before)) ||
+			A != r->a || X != r->x || Y != r->y || S != r->s - 2 ||
+			N != P >> 7 || Z != ((P >> 1) & 1) || C != (P & 1))
+			error(name, "gave up, but changed the state");
+		return NO;
+	}
+	if (!ok) {
+		error(name, "handled, but the ROM raises an error");
+		return YES;
+	}
+	if (pc != STOP) {
+		printf("  returned to $%04X\n", pc);
+		error(name, "wrong return address");
+		return YES;
+	}
+
+	/* the native code keeps N, Z and C only */
+	P = N << 7 | Z << 1 | C;
+	if (A != r_rom.a || X != r_rom.x || Y != r_rom.y || S != r_rom.s || P != (r_rom.p & 0x83)) {
+		printf("  ROM A=%02X X=%02X Y=%02X S=%02X P=%02X, native A=%02X X=%02X Y=%02X S=%02X P=%02X\n",
+			r_rom.a, r_rom.x, r_rom.y, r_rom.s, r_rom.p & 0x83, A, X, Y, S, P);
+		error(name, "registers differ");
+		return YES;
+	}
+	/* the stack below the return address is scratch */
+	memset(memory + 0x100, 0, r->s + 1);
+	memset(after + 0x100, 0, r->s + 1);
+	for (int i = 0; i < 65536; i++) {
+		if (memory[i] != after[i]) {
+			printf("  $%04X: ROM %02X, native %02X\n", i, after[i], memory[i]);
+			error(name, "memory differs");
+			break;
+		}
+	}
+	return YES;
+}
+
+/************************************************************
+ *
+ * Tokenizer
+ *
+ ************************************************************/
+
+static const char *line_pieces[] = {
+	"PRINT", "?", "FOR I=1 TO 10", "NEXT", "GOTO", "GOSUB 100", "IF A>B THEN 20",
+	"POKE 53280,0", "X=Y+Z*2", "A$=\"HELLO PRINT\"", "\"UNTERMINATED", "REM GOTO 10",
+	"DATA 1,GOTO,\"A:B\",3", ":", " ", "  ", "INPUT#1,A$", "LIST", "SYS 1", "PEEK(",
+	"ATN", "STR$(", "ABS", "AND", "OR", "NOT", "<=", ">=", "123", "ON X GOTO", "TAB(",
+	"SPC(", "GO TO", "FNA(", "DEF", "ST", "TI$", "\xFF", "\xC1\xC2", "PRI", "PRINTX",
+	"ENDX", "STOP", "RESTORE", "DIM A(10)", "LET", "READ", "WAIT", "GET", "CLR"
+};
+
+static void
+random_line(uint8_t *line)
+{
+	int len = 0;
+
+	while (len < MAX_LINE && rand() % 8) {
+		const char *s = line_pieces[rand() % (sizeof(line_pieces) / sizeof(*line_pieces))];
+		int n = strlen(s);
+		if (len + n > MAX_LINE)
+			break;
+		memcpy(line + len, s, n);
+		len += n;
+	}
+	line[len] = 0;
+}
+
+static void
+test_crnch()
+{
+	int handled = 0;
+
+	plugin_native = PLUGIN_NATIVE_CRNCH;
+	for (int t = 0; t < CRNCH_TRIALS; t++) {
+		emu_registers r = { rand(), rand(), rand(), 0xF0, rand() & 0xC3, 0 };
+
+		memset(memory + 0x0200, 0, 0x58);
+		random_line(memory + 0x0200);
+		/* usually the whole line, sometimes after a line number */
+		memory[0x7A] = rand() % 4 ? 0x00 : rand() % 4;
+		memory[0x7B] = 0x02;
+		handled += test_call("CRNCH", 0xA57C, plugin_crnch, &r);
+	}
+	printf("%-6s %d/%d handled\n", "CRNCH", handled, CRNCH_TRIALS);
+}
+
+/************************************************************
+ *
+ * Variable Lookup
+ *
+ ************************************************************/
+
+static int variables;
+static uint8_t names[MAX_VARIABLES][2];
+
+/* some float variables, and an integer and a string one to skip over */
+static void
+setup_variables()
+{
+	static const char *float_names[] = { "A", "B", "AB", "X1", "ZZ", "Q", "IN", "T" };
+	uint8_t *v = memory + VARIABLES;
+
+	variables = 0;
+	for (int i = 0; i < sizeof(float_names) / sizeof(*float_names); i++) {
+		names[variables][0] = float_names[i][0];
+		names[variables][1] = float_names[i][1];
+		variables++;
+	}
+	for (int i = 0; i < variables; i++) {
+		v[0] = names[i][0];
+		v[1] = names[i][1];
+		for (int j = 2; j < 7; j++)
+			v[j] = rand();
+		v += 7;
+	}
+	/* I% and S$ */
+	v[0] = 'I' | 0x80;
+	v[1] = 0x80;
+	v += 7;
+	v[0] = 'S';
+	v[1] = 0x80;
+	v += 7;
+
+	memory[0x2D] = VARIABLES & 0xFF;
+	memory[0x2E] = VARIABLES >> 8;
+	memory[0x2F] = (v - memory) & 0xFF;      /* ARYTAB */
+	memory[0x30] = (v - memory) >> 8;
+	memory[0x31] = memory[0x2F];             /* STREND */
+	memory[0x32] = memory[0x30];
+}
+
+static const char *term_starts[] = {
+	"", " ", "  ", "1", ".5", "-", "(", "\"S\"", "\xFF", "\xB4"
+};
+
+static const char *term_names[] = {
+	"I", "S", "C", "ABC", "X12", "QQ", "T1", "TI", "ST"
+};
+
+static const char *term_ends[] = {
+	"", "+1", "*2", ")", ":", ",", " ", "$", "%", "(1)", "=3", "\xAA", ";"
+};
+
+#define PICK(list) list[rand() % (sizeof(list) / sizeof(*list))]
+
+static void
+random_term(uint8_t *text)
+{
+	char term[32];
+
+	if (rand() % 4) {
+		/* a variable that exists */
+		const uint8_t *name = names[rand() % variables];
+		snprintf(term, sizeof(term), "%s%c%.1s%s", rand() % 8 ? "" : " ", name[0],
+			(const char *)&name[1], PICK(term_ends));
+	} else {
+		snprintf(term, sizeof(term), "%s%s%s", PICK(term_starts), rand() % 2 ? PICK(term_names) : "", PICK(term_ends));
+	}
+	strcpy((char *)text, term);
+}
+
+static void
+test_eval()
+{
+	int handled = 0;
+
+	plugin_native = PLUGIN_NATIVE_EVAL;
+	for (int t = 0; t < EVAL_TRIALS; t++) {
+		emu_registers r = { rand(), rand(), rand(), 0xF0, rand() & 0xC3, 0 };
+
+		setup_variables();
+		memset(memory + 0x0200, 0, 0x58);
+		random_term(memory + 0x0200);
+		memory[0x7A] = 0xFF;                 /* CHRGET goes to $0200 first */
+		memory[0x7B] = 0x01;
+		memory[0x0D] = rand();
+		memory[0x0E] = rand();
+		memory[0x10] = 0;
+		handled += test_call("EVAL", 0xAE86, plugin_eval, &r);
+	}
+	printf("%-6s %d/%d handled\n", "EVAL", handled, EVAL_TRIALS);
+}
+
+int
+main()
+{
+	setup_basic();
+
+	printf("testing the tokenizer...\n");
+	test_crnch();
+
+	printf("testing variable lookup...\n");
+	test_eval();
+
+	printf("%d errors\n", errors);
+	return errors != 0;
+}